@@ -303,6 +303,75 @@ namespace Mpe
 			return (*this)^aabb;
 		}
 
+		// intersection of AABB with ray origin+dir*t for t in [0..tMax] by slabs, invDir is inversed direction (0 for axes parallel to ray), tNear is distance of entry
+		MPE_FORCE_INLINE _b							intersectRay(const Vec3<type>& origin, const Vec3<type>& invDir, const type tMax, type& tNear) const
+		{
+			const AABB3<type>& t = *this;
+			type tl = (const type)0;
+			type th = tMax;
+			if (invDir.x!=(const type)0)
+			{
+				const type a = (t.l.x-origin.x)*invDir.x;
+				const type b = (t.h.x-origin.x)*invDir.x;
+				tl = Math::max<type>(tl, Math::min<type>(a, b));
+				th = Math::min<type>(th, Math::max<type>(a, b));
+			}
+			else if (origin.x<t.l.x || origin.x>t.h.x) return false;
+			if (invDir.y!=(const type)0)
+			{
+				const type a = (t.l.y-origin.y)*invDir.y;
+				const type b = (t.h.y-origin.y)*invDir.y;
+				tl = Math::max<type>(tl, Math::min<type>(a, b));
+				th = Math::min<type>(th, Math::max<type>(a, b));
+			}
+			else if (origin.y<t.l.y || origin.y>t.h.y) return false;
+			if (invDir.z!=(const type)0)
+			{
+				const type a = (t.l.z-origin.z)*invDir.z;
+				const type b = (t.h.z-origin.z)*invDir.z;
+				tl = Math::max<type>(tl, Math::min<type>(a, b));
+				th = Math::min<type>(th, Math::max<type>(a, b));
+			}
+			else if (origin.z<t.l.z || origin.z>t.h.z) return false;
+			tNear = tl;
+			return tl<=th;
+		}
+
+		// intersection of this AABB with other AABB moving by vec*t for t in [0..1] by slabs, invVec is inversed vector (0 for axes without movement), tEnter and tExit are times of contact
+		MPE_FORCE_INLINE _b							intersectMove(const AABB3<type>& aabb, const Vec3<type>& invVec, type& tEnter, type& tExit) const
+		{
+			const AABB3<type>& t = *this;
+			type tl = (const type)0;
+			type th = (const type)1;
+			if (invVec.x!=(const type)0)
+			{
+				const type a = (t.l.x-aabb.h.x)*invVec.x;
+				const type b = (t.h.x-aabb.l.x)*invVec.x;
+				tl = Math::max<type>(tl, Math::min<type>(a, b));
+				th = Math::min<type>(th, Math::max<type>(a, b));
+			}
+			else if (aabb.h.x<t.l.x || aabb.l.x>t.h.x) return false;
+			if (invVec.y!=(const type)0)
+			{
+				const type a = (t.l.y-aabb.h.y)*invVec.y;
+				const type b = (t.h.y-aabb.l.y)*invVec.y;
+				tl = Math::max<type>(tl, Math::min<type>(a, b));
+				th = Math::min<type>(th, Math::max<type>(a, b));
+			}
+			else if (aabb.h.y<t.l.y || aabb.l.y>t.h.y) return false;
+			if (invVec.z!=(const type)0)
+			{
+				const type a = (t.l.z-aabb.h.z)*invVec.z;
+				const type b = (t.h.z-aabb.l.z)*invVec.z;
+				tl = Math::max<type>(tl, Math::min<type>(a, b));
+				th = Math::min<type>(th, Math::max<type>(a, b));
+			}
+			else if (aabb.h.z<t.l.z || aabb.l.z>t.h.z) return false;
+			tEnter	= tl;
+			tExit	= th;
+			return tl<=th;
+		}
+
 		// intersection of AABB with axis-aligned plane X (YZ-plane)
 		MPE_FORCE_INLINE _b							intersectPlaneX(const type c) const
 		{
@@ -331,6 +400,67 @@ namespace Mpe
 		}
 
 
+		// check this AABB completely outside of plane (normal looks outside, dots with normal*dot<=offset are inside)
+		MPE_FORCE_INLINE _b							outsidePlane(const Vec3<type>& normal, const type offset) const
+		{
+			// corner nearest to inner side is checked
+			const AABB3<type>& t = *this;
+			const type x = normal.x>=(const type)0 ? t.l.x : t.h.x;
+			const type y = normal.y>=(const type)0 ? t.l.y : t.h.y;
+			const type z = normal.z>=(const type)0 ? t.l.z : t.h.z;
+			return normal.x*x + normal.y*y + normal.z*z > offset;
+		}
+
+		// check this AABB completely inside of plane (normal looks outside, dots with normal*dot<=offset are inside)
+		MPE_FORCE_INLINE _b							insidePlane(const Vec3<type>& normal, const type offset) const
+		{
+			// corner farthest to inner side is checked
+			const AABB3<type>& t = *this;
+			const type x = normal.x>=(const type)0 ? t.h.x : t.l.x;
+			const type y = normal.y>=(const type)0 ? t.h.y : t.l.y;
+			const type z = normal.z>=(const type)0 ? t.h.z : t.l.z;
+			return normal.x*x + normal.y*y + normal.z*z <= offset;
+		}
+
+		// intersection of this AABB with oriented box (axes are orthonormal, extent is half of size along axes)
+		// only 6 face axes are separated, so rare edge by edge cases are reported as intersection
+		MPE_FORCE_INLINE _b							intersectOBB(const Vec3<type>& center, const Vec3<type>& axisX, const Vec3<type>& axisY, const Vec3<type>& axisZ, const Vec3<type>& extent) const
+		{
+			const AABB3<type>& t = *this;
+			const Vec3<type> e = (t.h-t.l) / (const type)2;
+			const Vec3<type> d = center - t.middle();
+			const Vec3<type> aX(Math::max<type>(axisX.x, -axisX.x), Math::max<type>(axisX.y, -axisX.y), Math::max<type>(axisX.z, -axisX.z));
+			const Vec3<type> aY(Math::max<type>(axisY.x, -axisY.x), Math::max<type>(axisY.y, -axisY.y), Math::max<type>(axisY.z, -axisY.z));
+			const Vec3<type> aZ(Math::max<type>(axisZ.x, -axisZ.x), Math::max<type>(axisZ.y, -axisZ.y), Math::max<type>(axisZ.z, -axisZ.z));
+			// axes of AABB
+			if (Math::max<type>(d.x, -d.x) > e.x + aX.x*extent.x + aY.x*extent.y + aZ.x*extent.z) return false;
+			if (Math::max<type>(d.y, -d.y) > e.y + aX.y*extent.x + aY.y*extent.y + aZ.y*extent.z) return false;
+			if (Math::max<type>(d.z, -d.z) > e.z + aX.z*extent.x + aY.z*extent.y + aZ.z*extent.z) return false;
+			// axes of oriented box
+			const type dX = axisX.x*d.x + axisX.y*d.y + axisX.z*d.z;
+			const type dY = axisY.x*d.x + axisY.y*d.y + axisY.z*d.z;
+			const type dZ = axisZ.x*d.x + axisZ.y*d.y + axisZ.z*d.z;
+			if (Math::max<type>(dX, -dX) > extent.x + aX.x*e.x + aX.y*e.y + aX.z*e.z) return false;
+			if (Math::max<type>(dY, -dY) > extent.y + aY.x*e.x + aY.y*e.y + aY.z*e.z) return false;
+			if (Math::max<type>(dZ, -dZ) > extent.z + aZ.x*e.x + aZ.y*e.y + aZ.z*e.z) return false;
+			return true;
+		}
+
+		// check this AABB completely inside of oriented box (axes are orthonormal, extent is half of size along axes)
+		MPE_FORCE_INLINE _b							insideOBB(const Vec3<type>& center, const Vec3<type>& axisX, const Vec3<type>& axisY, const Vec3<type>& axisZ, const Vec3<type>& extent) const
+		{
+			const AABB3<type>& t = *this;
+			const Vec3<type> e = (t.h-t.l) / (const type)2;
+			const Vec3<type> d = center - t.middle();
+			const type dX = axisX.x*d.x + axisX.y*d.y + axisX.z*d.z;
+			const type dY = axisY.x*d.x + axisY.y*d.y + axisY.z*d.z;
+			const type dZ = axisZ.x*d.x + axisZ.y*d.y + axisZ.z*d.z;
+			if (Math::max<type>(dX, -dX) + Math::max<type>(axisX.x, -axisX.x)*e.x + Math::max<type>(axisX.y, -axisX.y)*e.y + Math::max<type>(axisX.z, -axisX.z)*e.z > extent.x) return false;
+			if (Math::max<type>(dY, -dY) + Math::max<type>(axisY.x, -axisY.x)*e.x + Math::max<type>(axisY.y, -axisY.y)*e.y + Math::max<type>(axisY.z, -axisY.z)*e.z > extent.y) return false;
+			if (Math::max<type>(dZ, -dZ) + Math::max<type>(axisZ.x, -axisZ.x)*e.x + Math::max<type>(axisZ.y, -axisZ.y)*e.y + Math::max<type>(axisZ.z, -axisZ.z)*e.z > extent.z) return false;
+			return true;
+		}
+
 		// set AABB by vertex
 		MPE_FORCE_INLINE const AABB3<type>			vertex(const Vec3<type>& dot)
 		{
@@ -393,6 +523,45 @@ namespace Mpe
 			return (l+h) / (const type)2;
 		}
 
+		// get half of surface area of AABB
+		MPE_FORCE_INLINE type						area(void) const
+		{
+			const type dx = h.x - l.x;
+			const type dy = h.y - l.y;
+			const type dz = h.z - l.z;
+			return dx*dy + dy*dz + dz*dx;
+		}
+
+		// get squared distance from dot to AABB (0 if dot is inside)
+		MPE_FORCE_INLINE type						distance2(const Vec3<type>& dot) const
+		{
+			const AABB3<type>& t = *this;
+			const type dx = Math::max<type>(Math::max<type>(t.l.x-dot.x, dot.x-t.h.x), (const type)0);
+			const type dy = Math::max<type>(Math::max<type>(t.l.y-dot.y, dot.y-t.h.y), (const type)0);
+			const type dz = Math::max<type>(Math::max<type>(t.l.z-dot.z, dot.z-t.h.z), (const type)0);
+			return dx*dx + dy*dy + dz*dz;
+		}
+
+		// get squared distance from dot to farthest corner of AABB
+		MPE_FORCE_INLINE type						distance2Max(const Vec3<type>& dot) const
+		{
+			const AABB3<type>& t = *this;
+			const type dx = Math::max<type>(dot.x-t.l.x, t.h.x-dot.x);
+			const type dy = Math::max<type>(dot.y-t.l.y, t.h.y-dot.y);
+			const type dz = Math::max<type>(dot.z-t.l.z, t.h.z-dot.z);
+			return dx*dx + dy*dy + dz*dz;
+		}
+
+		// get half of surface area of intersection of this AABB with other AABB (0 if they don't intersect)
+		MPE_FORCE_INLINE type						overlap(const AABB3<type>& aabb) const
+		{
+			const AABB3<type>& t = *this;
+			const type dx = Math::max<type>(Math::min<type>(t.h.x, aabb.h.x) - Math::max<type>(t.l.x, aabb.l.x), (const type)0);
+			const type dy = Math::max<type>(Math::min<type>(t.h.y, aabb.h.y) - Math::max<type>(t.l.y, aabb.l.y), (const type)0);
+			const type dz = Math::max<type>(Math::min<type>(t.h.z, aabb.h.z) - Math::max<type>(t.l.z, aabb.l.z), (const type)0);
+			return dx*dy + dy*dz + dz*dx;
+		}
+
 		// check this AABB completely cover other AABB
 		MPE_FORCE_INLINE _b							cover(const AABB3<type>& aabb) const
 		{
@@ -7,6 +7,7 @@
 #define	__MPE_AVL__
 
 #include "MpeSimpleTypes.h"
+#include "MpeAllocator.h"
 
 
 namespace Mpe
@@ -25,6 +26,8 @@ namespace Mpe
 		};
 
 	private:
+		static const _ui s_numNodesGrow = 16;	// minimal number of nodes of grown storage (heights of nodes stay below it)
+
 		Node*	_pNode;
 		_ui*	_pFreeNode;
 		_ui		_numNodes;
@@ -33,18 +36,23 @@ namespace Mpe
 		_ui		_rootId;
 		_ui		_minId;
 		_ui		_maxId;
+		Allocator	_allocator;
 
 	public:
 		AVL(void);
 		AVL(_ui numNodesMax);
+		AVL(_ui numNodesMax, const Allocator& alloc);
 		~AVL(void);
 
 		_b   __fastcall		init(_ui numNodesMax);
+		_b   __fastcall		allocator(const Allocator& alloc);				// source of storage of nodes, false if storage is already allocated
 		void __fastcall		clear(void);
 
 		_ui  __fastcall		numNodesMax(void) const;
 		_ui  __fastcall		numNodes(void) const;
 		_ui  __fastcall		numFreeNodes(void) const;
+		_b   __fastcall		reserve(_ui numNodesMax);						// grow storage to at least numNodesMax nodes, nodes keep their indices
+		_b   __fastcall		shrinkToFit(void);								// cut storage to defined nodes (free nodes inside of them stay)
 
 		_ui  __fastcall		rootId(void) const;								// index of root node
 		_ui  __fastcall		minId(void) const;								// index of node with minimal key value
@@ -65,6 +73,8 @@ namespace Mpe
 	private:
 		void __fastcall		reset(void);
 		void __fastcall		flush(void);
+		_b   __fastcall		grow(_ui numNodesMin);							// grow storage geometrically
+		_b   __fastcall		relocate(_ui numNodesMax);						// move nodes to storage of numNodesMax nodes
 
 		_ui  __fastcall		addNodeRaw(void);
 		void __fastcall		delNodeRaw(_ui nodeId);
@@ -89,6 +99,14 @@ namespace Mpe
 
 	template <typename type, typename data> AVL<type,data>::AVL(_ui numNodesMax)
 	{
+		reset();
+		init(numNodesMax);
+	}
+
+	template <typename type, typename data> AVL<type,data>::AVL(_ui numNodesMax, const Allocator& alloc)
+	{
+		reset();
+		_allocator = alloc;
 		init(numNodesMax);
 	}
 
@@ -102,21 +120,25 @@ namespace Mpe
 	template <typename type, typename data> _b __fastcall AVL<type,data>::init(_ui numNodesMax)
 	{
 		flush();
-		try
-		{
-			_pNode		= new Node[numNodesMax];
-			_pFreeNode	= new _ui[numNodesMax];
-		}
-		catch(...)
+		_pNode			= _allocator.create<Node>(numNodesMax);
+		_pFreeNode		= _allocator.create<_ui>(numNodesMax);
+		_numNodesMax	= numNodesMax;
+		if (!_pNode || !_pFreeNode)
 		{
 			flush();
 			return false;
 		}
-		_numNodesMax	= numNodesMax;
 		_numFreeNodes	= 0;
 		return true;
 	}
 
+	template <typename type, typename data> _b __fastcall AVL<type,data>::allocator(const Allocator& alloc)
+	{
+		if (_pNode) return false;
+		_allocator = alloc;
+		return true;
+	}
+
 	template <typename type, typename data> void __fastcall AVL<type,data>::clear(void)
 	{
 		_numNodes		= 0;
@@ -143,6 +165,19 @@ namespace Mpe
 		return _numFreeNodes;
 	}
 
+	template <typename type, typename data> _b __fastcall AVL<type,data>::reserve(_ui numNodesMax)
+	{
+		if (numNodesMax<=_numNodesMax) return true;
+		return relocate(numNodesMax);
+	}
+
+	template <typename type, typename data> _b __fastcall AVL<type,data>::shrinkToFit(void)
+	{
+		const _ui numNodesMax = _numNodes>s_numNodesGrow ? _numNodes : s_numNodesGrow;
+		if (numNodesMax>=_numNodesMax) return true;
+		return relocate(numNodesMax);
+	}
+
 	
 
 	template <typename type, typename data> _ui __fastcall AVL<type,data>::rootId(void) const
@@ -191,6 +226,7 @@ namespace Mpe
 		//    L                L   N
 		//
 
+		if (!_numFreeNodes && _numNodes>=_numNodesMax && !grow(_numNodes+1)) return _numNodesMax;
 		const _ui nodePId = find(v);
 		const _ui nodeNId = addNodeRaw();
 		if (nodeNId>=_numNodesMax) return _numNodesMax;
@@ -398,11 +434,54 @@ namespace Mpe
 	
 	template <typename type, typename data> void __fastcall AVL<type,data>::flush(void)
 	{
-		try	{	delete[] _pNode;		}	catch(...)	{};
-		try	{	delete[] _pFreeNode;	}	catch(...)	{};
+		_allocator.destroy(_pNode, _numNodesMax);
+		_allocator.destroy(_pFreeNode, _numNodesMax);
 		reset();
 	}
 
+	template <typename type, typename data> _b __fastcall AVL<type,data>::grow(_ui numNodesMin)
+	{
+		_ui numNodesMax = _numNodesMax<((_ui)-1)/2 ? _numNodesMax*2 : (_ui)-1;
+		if (numNodesMax<numNodesMin)		numNodesMax = numNodesMin;
+		if (numNodesMax<s_numNodesGrow)	numNodesMax = s_numNodesGrow;
+		return relocate(numNodesMax);
+	}
+
+	template <typename type, typename data> _b __fastcall AVL<type,data>::relocate(_ui numNodesMax)
+	{
+		// nodes keep their indices, links to none and marks of free nodes (equal to old maximal number of nodes) are renumbered
+		if (numNodesMax<_numNodes) return false;
+		Node* pNode		= _allocator.create<Node>(numNodesMax);
+		_ui* pFreeNode	= _allocator.create<_ui>(numNodesMax);
+		if (!pNode || !pFreeNode)
+		{
+			_allocator.destroy(pNode, numNodesMax);
+			_allocator.destroy(pFreeNode, numNodesMax);
+			return false;
+		}
+		const _ui nodeIdNone = _numNodesMax;
+		for (_ui id = 0; id<_numNodes; id++)
+		{
+			Node& node = pNode[id];
+			node = _pNode[id];
+			if (node.h==nodeIdNone)		node.h		= numNodesMax;
+			if (node.idP==nodeIdNone)	node.idP	= numNodesMax;
+			if (node.idL==nodeIdNone)	node.idL	= numNodesMax;
+			if (node.idR==nodeIdNone)	node.idR	= numNodesMax;
+		}
+		for (_ui i = 0; i<_numFreeNodes; i++)
+			pFreeNode[i] = _pFreeNode[i];
+		if (_rootId==nodeIdNone)	_rootId	= numNodesMax;
+		if (_minId==nodeIdNone)		_minId	= numNodesMax;
+		if (_maxId==nodeIdNone)		_maxId	= numNodesMax;
+		_allocator.destroy(_pNode, _numNodesMax);
+		_allocator.destroy(_pFreeNode, _numNodesMax);
+		_pNode			= pNode;
+		_pFreeNode		= pFreeNode;
+		_numNodesMax	= numNodesMax;
+		return true;
+	}
+
 
 
 	template <typename type, typename data> _ui __fastcall AVL<type,data>::addNodeRaw(void)
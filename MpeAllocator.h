@@ -0,0 +1,134 @@
+
+// (c) Micelanholies 2015
+// Micelanholies Physics Engine
+// Allocator - aligned storage of node arrays with pluggable source of memory
+
+#ifndef	__MPE_ALLOCATOR__
+#define	__MPE_ALLOCATOR__
+
+#include "MpeSimpleTypes.h"
+#include <cstddef>
+#include <new>
+
+
+namespace Mpe
+{
+
+	//
+	// node arrays of trees are taken from allocAlloc and returned to allocFree of allocator,
+	// so every world could place its nodes in own arena, on huge pages or near its NUMA node.
+	// blocks are requested with alignment of s_alignment at least (cache line, widest SIMD register),
+	// by default they are taken from heap and aligned inside of enlarged block:
+	//
+	//	 heap block:	[ padding | raw pointer | aligned block of size bytes ... ]
+	//	                                        ^ 64 bytes boundary
+	//
+	// allocator is copied by value into tree, pUser must outlive storage of tree
+	//
+	class Allocator
+	{
+	public:
+		static const _ui s_alignment	= 64;							// minimal alignment of blocks in bytes
+
+		typedef void* (*allocFunc)(void* pUser, size_t size, size_t alignment);	// block of size bytes aligned by alignment (power of two), NULL if there's no memory
+		typedef void  (*freeFunc)(void* pUser, void* p, size_t size);			// return block of size bytes taken by allocFunc
+
+		allocFunc	allocAlloc;											// source of blocks
+		freeFunc	allocFree;											// release of blocks
+		void*		pUser;												// user data of source (arena, NUMA node of world)
+
+	public:
+		Allocator(void);												// aligned blocks of heap
+		Allocator(allocFunc alloc, freeFunc free, void* pUserData);
+
+		template <typename type>
+		type* __fastcall	create(_ui num) const;						// array of num default constructed items in aligned block, NULL if there's no memory or block isn't aligned
+		template <typename type>
+		void  __fastcall	destroy(type* p, _ui num) const;			// destruct items of array and release its block
+
+		static void* heapAlloc(void* pUser, size_t size, size_t alignment);	// pUser isn't used
+		static void  heapFree(void* pUser, void* p, size_t size);				// pUser and size aren't used
+	};
+
+
+
+	inline Allocator::Allocator(void)
+	{
+		allocAlloc	= &Allocator::heapAlloc;
+		allocFree	= &Allocator::heapFree;
+		pUser		= NULL;
+	}
+
+	inline Allocator::Allocator(allocFunc alloc, freeFunc free, void* pUserData)
+	{
+		allocAlloc	= alloc;
+		allocFree	= free;
+		pUser		= pUserData;
+	}
+
+
+
+	template <typename type> type* __fastcall Allocator::create(_ui num) const
+	{
+		const size_t size = sizeof(type)*(size_t)num;
+		void* p = allocAlloc(pUser, size, s_alignment);
+		if (!p) return NULL;
+		// block of user source has to keep alignment too
+		if ((size_t)p % s_alignment)
+		{
+			allocFree(pUser, p, size);
+			return NULL;
+		}
+		type* pItem = (type*)p;
+		_ui id = 0;
+		try
+		{
+			for (; id<num; id++)
+				new (pItem+id) type;
+		}
+		catch(...)
+		{
+			while (id) pItem[--id].~type();
+			allocFree(pUser, p, size);
+			return NULL;
+		}
+		return pItem;
+	}
+
+	template <typename type> void __fastcall Allocator::destroy(type* p, _ui num) const
+	{
+		if (!p) return;
+		for (_ui id = 0; id<num; id++)
+			p[id].~type();
+		allocFree(pUser, p, sizeof(type)*(size_t)num);
+	}
+
+
+
+	inline void* Allocator::heapAlloc(void*, size_t size, size_t alignment)
+	{
+		char* pRaw = NULL;
+		try
+		{
+			pRaw = new char[size + alignment + sizeof(void*)];
+		}
+		catch(...)
+		{
+			return NULL;
+		}
+		const size_t address = (size_t)(pRaw + sizeof(void*));
+		char* pAligned = pRaw + sizeof(void*) + ((alignment - address%alignment) % alignment);
+		((char**)pAligned)[-1] = pRaw;
+		return pAligned;
+	}
+
+	inline void Allocator::heapFree(void*, void* p, size_t)
+	{
+		if (!p) return;
+		char* pRaw = ((char**)p)[-1];
+		try	{	delete[] pRaw;	}	catch(...)	{};
+	}
+
+};		// namespace Mpe
+
+#endif	// __MPE_ALLOCATOR__
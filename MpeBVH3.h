@@ -8,17 +8,41 @@
 
 #include "MpeVec3.h"
 #include "MpeAABB3.h"
+#include "MpeAllocator.h"
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <functional>
 
 
 namespace Mpe
 {
 
+	template <class callBack, typename type, typename data, _ui width> class WBVH3;
+	template <class callBack, typename type, typename data, typename quant> class QBVH3;
+
 	template <class callBack, typename type, typename data> class BVH3
 	{
+		template <class callBackW, typename typeW, typename dataW, _ui width> friend class WBVH3;	// wide tree is collapsed from nodes
+		template <class callBackQ, typename typeQ, typename dataQ, typename quant> friend class QBVH3;	// compressed tree is quantized from nodes
+
 
 	public:
 		static const _ui  s_numChildren	= 2;							// total number of children per node
 		static const type s_avgCoordTolerance = (const type)0.0001;		// coordinate compare tolerance for averages
+		static const _ui  s_numBinsMin	= 2;							// minimal number of bins of SAH build
+		static const _ui  s_numBinsMax	= 64;							// maximal number of bins of SAH build
+		static const _ui  s_numCodeBits	= 10;							// number of bits per axis of short morton code (30 bits code)
+		static const _ui  s_numCodeBitsW	= 21;							// number of bits per axis of wide morton code (63 bits code)
+		static const _ui  s_numRadixBits	= 8;							// number of bits per pass of radix sort
+		static const _ui  s_numTaskLeaves	= 4096;							// minimal number of leaves of branch to build on separate thread
+		static const _ui  s_numPacketRays	= 8;							// number of rays of packet of batched cast
+		static const _ui  s_numPacketQueries	= 8;							// number of AABB queries of packet of batched check
+		static const _ui  s_numHitsLost	= 0xFFFFFFFF;					// result of batched check which lost hits by lack of memory
+		static const _ui  s_numCullPlanes	= 32;							// maximal number of planes of frustum (bits of plane mask)
+		static const _ui  s_numNodesGrow	= 16;							// minimal number of nodes of grown storage
+		static const _ui  s_imageVersion	= 1;							// version of serialized image, images of other versions are not viewed
+		static const _ui  s_imageAlignment	= 64;							// alignment of image and of its arrays in bytes
 
 		struct Elem
 		{
@@ -30,67 +54,325 @@ namespace Mpe
 			data*		pData;											// pointer to callBack holder data
 		};
 
+		struct Pair
+		{
+			_ui			nodeAId;										// index of first leaf node of pair
+			_ui			nodeBId;										// index of second leaf node of pair
+		};
+
+		struct Hit
+		{
+			_ui			queryId;										// index of query element of batch
+			_ui			nodeId;											// index of intersected leaf node
+		};
+
+		struct Near
+		{
+			_ui			nodeId;											// index of leaf node (or node in queue of search)
+			type		dist2;											// squared distance to element of leaf (or to AABB of node)
+		};
+
+		struct Sweep
+		{
+			_ui			nodeId;											// index of leaf node (or node in stack of search)
+			type		tEnter;											// time of first contact of moving AABB with leaf in [0..1]
+			type		tExit;											// time of last contact of moving AABB with leaf in [0..1]
+		};
+
+		struct Plane
+		{
+			Vec3<type>	normal;											// normal of plane looking outside
+			type		offset;											// dots with normal*dot<=offset are inside
+		};
+
+		struct OBB
+		{
+			Vec3<type>	center;											// center of oriented box
+			Vec3<type>	axis[3];										// orthonormal axes of oriented box
+			Vec3<type>	extent;											// half of size along axes
+		};
+
 	private:
 		static const _ui s_childLId		= 0;							// index of left child
 		static const _ui s_childRId		= 1;							// index of right child
+		static const _ui s_numStackNodes	= 64;							// number of nodes of traversal stack on thread stack, deeper trees allocate it
+		static const _ui s_volumeSphere	= 0;							// culling by sphere
+		static const _ui s_volumePlanes	= 1;							// culling by planes of half-space or frustum
+		static const _ui s_volumeOBB	= 2;							// culling by oriented box
 
 		struct Node
 		{
 			_ui			parentId;										// index of parent node
-			_ui			childId[s_numChildren];							// index of child nodes
 			_ui			level;											// distance from root node
 			_ui			maxLeafDistance;								// maximal distance to leaf (0 for leaf)
 			_ui			parentChildId;									// index of this node of parent as a child
 			_ui			numAvg;											// number of all children averages
 			_ui			uid;											// unique index of node (or base element)
-			Elem		elem;											// element data of node
+			Elem		elem;											// element data of node (AABB is kept for leaf only, enlarged in fat mode)
+			AABB3<type>	aabbTight;										// AABB of leaf element as it was set
+			_b			bRefit;											// node is on path from changed leaf to root (used by refit only)
+		};
+
+		// traversal data of node is kept apart of Node, so queries walk over 32 bytes per node (for float)
+		// and touch Node for elements of hit leaves only
+		struct Hot
+		{
+			AABB3<type>	aabb;											// AABB of node (enlarged for leaf in fat mode)
+			_ui			childId[s_numChildren];							// index of child nodes (out of nodes for leaf)
+		};
+
+		struct Key
+		{
+			Vec3<type>	avg;											// average of leaf
+			_ui			nodeId;											// index of leaf node
+		};
+
+		struct Bin
+		{
+			AABB3<type>	aabb;											// AABB of leaves of bin
+			_ui			num;											// number of leaves of bin
+		};
+
+		struct SAH
+		{
+			_ui*		pIndex;											// indices of leaf nodes to split
+			Bin*		pBin;											// bins of one axis
+			type*		pArea;											// areas of right sides of bins split
+			_ui			numBins;										// number of bins per axis
+		};
+
+		typedef unsigned long long MortonCode;
+
+		struct LBVH
+		{
+			MortonCode*	pCode;											// morton codes of leaves sorted by code
+			MortonCode*	pCodeTmp;										// temporary codes of radix sort
+			_ui*		pIndex;											// indices of leaf nodes sorted by code
+			_ui*		pIndexTmp;										// temporary indices of radix sort
+			_ui			numLeaves;										// number of leaves
+			_ui			numBits;										// number of bits per axis of code
+			AABB3<type>	aabbAvg;										// AABB of all leaves averages
+		};
+
+		struct Cast
+		{
+			_ui			nodeId;											// index of node to visit
+			type		tNear;											// distance of entry of ray to AABB of node
+		};
+
+		struct Packet
+		{
+			type		ox[s_numPacketRays];								// origins of rays by axes
+			type		oy[s_numPacketRays];
+			type		oz[s_numPacketRays];
+			type		ix[s_numPacketRays];								// inversed directions of rays by axes (0 for parallel axis)
+			type		iy[s_numPacketRays];
+			type		iz[s_numPacketRays];
+			type		t[s_numPacketRays];									// lengths of rays
+		};
+
+		struct Query
+		{
+			type		lx[s_numPacketQueries];								// low corners of AABB of queries by axes
+			type		ly[s_numPacketQueries];
+			type		lz[s_numPacketQueries];
+			type		hx[s_numPacketQueries];								// high corners of AABB of queries by axes
+			type		hy[s_numPacketQueries];
+			type		hz[s_numPacketQueries];
+			type		alx[s_numPacketQueries];							// low corners of AABB of subtraction of queries by axes
+			type		aly[s_numPacketQueries];
+			type		alz[s_numPacketQueries];
+			type		ahx[s_numPacketQueries];							// high corners of AABB of subtraction of queries by axes
+			type		ahy[s_numPacketQueries];
+			type		ahz[s_numPacketQueries];
+			_ui			queryId[s_numPacketQueries];						// indices of queries of batch
+		};
+
+		struct HitBuffer
+		{
+			Hit*		pHit;											// hits
+			_ui			numHits;										// number of hits, could be more than size of buffer
+			_ui			numHitsMax;										// size of buffer
+			_b			bGrow;											// buffer is owned and grows by demand
+			_b			bLost;											// some hits are lost by lack of memory
+		};
+
+		struct Batch
+		{
+			const Elem*		pElem;										// query elements
+			const _ui*		pIndex;										// indices of query elements sorted by morton codes
+			_ui				numElements;								// number of query elements
+			_ui				numTasks;									// number of tasks of batch
+			_b				bSubAvg;									// skip nodes covered by AABB of subtraction
+			_b				bOrdered;									// hits are merged in order of tasks after all tasks
+			HitBuffer*		pBuffer;									// hits of every task
+			HitBuffer		hits;										// merged hits (buffer of caller)
+			std::atomic<_ui>	numHits;								// number of merged hits of unordered batch
+		};
+
+		struct Heap
+		{
+			Near*		pNear;											// binary heap of nodes by distances, the nearest is first
+			_ui			numNear;										// number of nodes of heap
+			_ui			numNearMax;										// size of heap
+			_b			bOwn;											// heap is allocated by demand
+		};
+
+		struct PacketCast
+		{
+			_ui			nodeId;											// index of node to visit
+			_ui			mask;											// rays of packet to check with node
+		};
+
+		struct Volume
+		{
+			_ui			volumeType;										// type of culling volume (sphere, planes or oriented box)
+			Vec3<type>	center;											// center of sphere
+			type		radius2;										// squared radius of sphere
+			const Plane* pPlane;										// planes of half-space or frustum
+			const OBB*	pOBB;											// oriented box
+		};
+
+		struct Cull
+		{
+			_ui			nodeId;											// index of node to visit
+			_ui			mask;											// planes to check with node (0 if node is completely inside)
+		};
+
+		struct Refit
+		{
+			std::atomic<_ui>*	pArrival;									// number of children arrived to node
+			std::atomic<_b>		bUpdate;									// all leaves are updated successfully
+			callBack*			pCallBackClass;								// callBack holder of update
+			_b (callBack::*updateFunc)(Elem& elem);							// update function of leaves, called from many threads
+		};
+
+		typedef unsigned long long ImageSize;
+
+		struct Image
+		{
+			_ui			magic;											// s_imageMagic, image of other byte order doesn't match
+			_ui			version;										// s_imageVersion
+			_ui			sizeType;										// size of coordinate type
+			_ui			sizeNode;										// size of Node
+			_ui			sizeHot;										// size of Hot
+			_ui			numNodes;										// number of nodes (and index of none)
+			_ui			numFreeNodes;									// number of free nodes inside of nodes
+			_ui			rootNodeId;										// index of root node
+			_ui			optimizeNodeId;									// index of next node to optimize
+			_ui			flags;											// s_imageAvgOrder, s_imageFat, s_imageRotation, s_imageLevelLazy
+			type		fatMargin;										// margin of enlarged AABB of leaves
+			ImageSize	offsetNode;										// offset of nodes from begin of image
+			ImageSize	offsetHot;										// offset of bounds and children of nodes
+			ImageSize	offsetFreeNode;									// offset of indices of free nodes
+			ImageSize	size;											// size of whole image
+			ImageSize	checksum;										// checksum of whole image with zero checksum
 		};
 
+		static const _ui s_imageMagic		= 0x3348564D;					// "MVH3"
+		static const _ui s_imageAvgOrder	= 1;							// children are ordered by averages
+		static const _ui s_imageFat			= 2;							// leaves are stored with enlarged AABB
+		static const _ui s_imageRotation	= 4;							// branches are rotated along modified paths
+		static const _ui s_imageLevelLazy	= 8;							// levels inside of rotated branches are not updated
+		static const ImageSize s_imageChecksumBasis	= 14695981039346656037ULL;	// initial value of FNV-1a checksum
+
 
 	private:
-		Node*	_pNode;													// nodes of BVH
+		Node*	_pNode;													// nodes of BVH, data for maintenance and elements of leaves
+		Hot*	_pHot;													// bounds and children of nodes (the only data read by traversal)
 		_ui*	_pFreeNode;												// indices of free nodes
 		_ui		_numNodesMax;											// maximal number of nodes
 		_ui		_numNodes;												// number of defined nodes
 		_ui		_numFreeNodes;											// number of free nodes inside of nodes array
 		_ui		_rootNodeId;											// index of parent node of all nodes
+		_b		_bAvgOrder;												// children are ordered by averages (kept by restructurize)
+		_b		_bFat;													// leaves are stored with enlarged AABB
+		type	_fatMargin;												// margin of enlarged AABB of leaves
+		_b		_bRotation;												// branches are rotated along modified paths
+		_b		_bLevelLazy;											// levels inside of rotated branches are not updated (they are used only by average order)
+		_ui		_optimizeNodeId;										// index of next node to optimize
+		Allocator	_allocator;											// source of aligned storage of nodes
+		_b		_bView;													// nodes are in image of caller, tree is read-only
 
 	public:
 		BVH3(void);
 		BVH3(_ui numNodesMax);
+		BVH3(_ui numNodesMax, const Allocator& alloc);
 		~BVH3(void);
 
 		typedef _b (callBack::*callBackIntersectionFunc)(const Elem& elem, const Elem& elemBVH);
 		typedef _b (callBack::*callBackUpdateFunc)(Elem& elem);
+		typedef type (callBack::*callBackDistanceFunc)(const Vec3<type>& dot, const Elem& elemBVH);	// squared distance from dot to element, not less than to its AABB
+		typedef _b (callBack::*callBackCastFunc)(const Vec3<type>& origin, const Vec3<type>& dir, type& t, const Elem& elemBVH);	// true if element is hit not farther than t, t is set to distance of hit
 
 
 		_b   __fastcall		init(_ui numNodesMax);
+		_b   __fastcall		allocator(const Allocator& alloc);			// source of storage of nodes, false if storage is already allocated (set it before init)
 
 		_ui  __fastcall		numNodesMax(void) const;
 		_ui  __fastcall		numNodes(void) const;
 		_ui  __fastcall		numFreeNodes(void) const;
+		_b   __fastcall		reserve(_ui numNodesMax);					// grow storage to at least numNodesMax nodes, nodes keep their indices
+		_b   __fastcall		shrinkToFit(void);							// cut storage to defined nodes (free nodes inside of them stay, compact removes them)
+		static _ui __fastcall	numNodesBuild(_ui numElements);			// exact number of nodes of tree built over numElements leaves
 
 		_b   __fastcall		define(const Elem* pElem, _ui numElements);
 
 		_ui  __fastcall		push(const Elem& elem);
 		_b   __fastcall		build(void);
+		_b   __fastcall		build(_ui numThreads);						// build by median split, branches are built on up to numThreads threads (leaves of built tree are moved to indices 0..N-1 and rebuilt)
+		_b   __fastcall		buildSAH(_ui numBins);						// build by binned surface area heuristic, more bins - better tree but slower build
+		_b   __fastcall		buildLinear(_b bWideCode, _ui numThreads);	// build by morton codes of averages (30 or 63 bits) in linear time
 
 		_ui  __fastcall		add(const Elem& elem);						// add new element to BVH, return index of element node
 		_b   __fastcall		del(_ui nodeId);							// delete node of element, false if not a leaf
 		_b   __fastcall		get(_ui nodeId, Elem& elem) const;			// get element of node, false if not a leaf
 		_ui  __fastcall		set(_ui nodeId, Elem& elem);				// set element of node, update BVH, false if not a leaf
+		_ui  __fastcall		set(_ui nodeId, Elem& elem, const Vec3<type>& vel);	// set element of moving node, in fat mode BVH is updated only when AABB leaves enlarged AABB
 		_b   __fastcall		check(const Elem& elem, _b bOneIntersection, _b bSubAvg, callBack& callBackClass, callBackIntersectionFunc intersectionFunc) const;
+		_ui  __fastcall		checkBatch(const Elem* pElem, _ui numElements, _b bSubAvg, Hit* pHit, _ui numHitsMax) const;	// check of many elements by packets, return number of hits even if it's more than numHitsMax (s_numHitsLost if hits are lost by lack of memory)
+		_ui  __fastcall		checkBatch(const Elem* pElem, _ui numElements, _b bSubAvg, Hit* pHit, _ui numHitsMax, _ui numThreads, _b bOrdered) const;	// batch is split to up to numThreads threads, ordered hits are the same as of one thread
+		_ui  __fastcall		cast(const Vec3<type>& origin, const Vec3<type>& dir, type& t, _b bAnyHit, callBack& callBackClass, callBackCastFunc castFunc) const;	// closest (or any) leaf hit by origin+dir*[0..t], t is distance of hit, return index of leaf node
+		_ui  __fastcall		cast(const Vec3<type>* pOrigin, const Vec3<type>* pDir, type* pT, _ui* pNodeHitId, _ui numRays, _b bAnyHit, callBack& callBackClass, callBackCastFunc castFunc) const;	// batched cast by packets of coherent rays, return number of rays with hit
+		_ui  __fastcall		nearest(const Vec3<type>& dot, const type& dist2Max, Near* pNear, _ui numNearMax, callBack& callBackClass, callBackDistanceFunc distanceFunc) const;	// up to numNearMax nearest leaves not farther than dist2Max in order of distance, distanceFunc could be NULL to use leaf AABB, numNodesMax if queue is out of memory
+		_ui  __fastcall		radius(const Vec3<type>& dot, const type& dist2Max, Near* pNear, _ui numNearMax, callBack& callBackClass, callBackDistanceFunc distanceFunc) const;	// all leaves not farther than dist2Max unordered, return number of leaves even if it's more than numNearMax
+		_ui  __fastcall		sweep(const AABB3<type>& aabb, const Vec3<type>& vec, Sweep* pSweep, _ui numSweepsMax) const;	// up to numSweepsMax leaves touched by aabb moving by vec in order of time of entry
+		_ui  __fastcall		sphere(const Vec3<type>& center, const type& radius, _ui* pNodeId, _ui numNodeIdsMax) const;	// all leaves intersected by sphere, return number of leaves even if it's more than numNodeIdsMax
+		_ui  __fastcall		halfSpace(const Plane& plane, _ui* pNodeId, _ui numNodeIdsMax) const;	// all leaves not completely outside of plane, return number of leaves
+		_ui  __fastcall		frustum(const Plane* pPlane, _ui numPlanes, _ui* pNodeId, _ui numNodeIdsMax) const;	// all leaves not completely outside of any of up to s_numCullPlanes planes, return number of leaves
+		_ui  __fastcall		obb(const OBB& obb, _ui* pNodeId, _ui numNodeIdsMax) const;	// all leaves intersected by oriented box, return number of leaves
+		_ui  __fastcall		pairs(Pair* pPair, _ui numPairsMax) const;	// all pairs of intersected leaves (each once), return number of pairs even if it's more than numPairsMax
+		_ui  __fastcall		pairs(const BVH3& bvh, Pair* pPair, _ui numPairsMax) const;	// all pairs of intersected leaves of this (A) and other (B) BVH, return number of pairs
 		_b   __fastcall		exist(_ui nodeId) const;
 
 		_b   __fastcall		update(callBack& callBackClass, callBackUpdateFunc updateFunc);
+		_b   __fastcall		update(callBack& callBackClass, callBackUpdateFunc updateFunc, _ui numThreads);	// leaves are updated and refitted bottom-up on up to numThreads threads, updateFunc must be thread safe
+		_ui  __fastcall		refit(const _ui* pNodeId, _ui numNodeIds, callBack& callBackClass, callBackUpdateFunc updateFunc);	// update listed leaves and refit only their paths to root, return number of recalculated nodes
 
 		_b   __fastcall		verify(void) const;
 
+		void __fastcall		fat(_b bFat, const type& margin);			// fat mode, leaves AABB are enlarged by margin and extended by velocity on set
+		void __fastcall		rotation(_b bRotation);						// rotation mode, add/del/set rotate branches along modified path to reduce surface area
+		_ui  __fastcall		optimize(_ui maxRotations);					// rotate up to maxRotations branches to reduce surface area, continues from last call, return number of rotations
+		_b   __fastcall		compact(_b bVanEmdeBoas, _ui* pNodeIdNew);	// relayout nodes in depth first (or van Emde Boas) order without free nodes, pNodeIdNew (could be NULL) gets new index of every old node (out of nodes for free one), false if tree is broken
+
+		size_t __fastcall	imageSize(void) const;						// size of serialized image of tree in bytes
+		_b   __fastcall		save(void* pImage, size_t size) const;		// write position independent image of tree to buffer aligned by s_imageAlignment, pData of elements is not kept
+		_b   __fastcall		view(const void* pImage, size_t size, _b bVerify);	// use image (memory mapped file) in place as read-only tree without copy, bVerify checks checksum and verify()
+		_b   __fastcall		readOnly(void) const;						// tree is view of image, only queries are allowed
+
 	private:
 		void __fastcall		reset(void);
 		void __fastcall		flush(void);
+		_b   __fastcall		grow(_ui numNodesMin);																			// O(N)
+		_b   __fastcall		relocate(_ui numNodesMax);																		// O(N)
+		void __fastcall		relink(Node& node, Hot& hot, _ui nodeIdNone, _ui nodeIdNoneNew) const;							// O(1)
+		ImageSize __fastcall	imageAlign(ImageSize size) const;															// O(1)
+		ImageSize __fastcall	imageChecksum(const void* pImage, ImageSize size, ImageSize checksum) const;									// O(N)
 
 		_ui  __fastcall		addNodeRaw(void);																				// O(1)
+		_ui  __fastcall		gatherLeaves(void);																				// O(N)
+		void __fastcall		setLeaf(_ui nodeId, const Elem& elem, const Vec3<type>& vel);									// O(1)
 		void __fastcall		delNodeRaw(_ui nodeId);																			// O(1)
 
 		_ui  __fastcall		getNeighborNode(_ui nodeId) const;																// O(1)
@@ -118,24 +400,66 @@ namespace Mpe
 		void __fastcall		updateChildren(_ui nodeId);																		// O(N log N)
 		_b   __fastcall		recalculate(_ui nodeId);																		// O(N)
 		_b   __fastcall		restructurize(_ui nodeId, _ui rootNodeId, _ui childSwap);										// O(N log N)
-
-		void __fastcall		sortX(_ui iLo, _ui iHi);																		// O(N log N)
-		void __fastcall		sortY(_ui iLo, _ui iHi);																		// O(N log N)
-		void __fastcall		sortZ(_ui iLo, _ui iHi);																		// O(N log N)
-
-		_ui  __fastcall		sort(_ui iLo, _ui iHi, _ui level);																// O(N log2 N)
-
-		void __fastcall		swapLeaf(_ui iFrom, _ui iTo);																	// O(1)
-		void __fastcall		sortByUid(_ui iLO, _ui iHi);																	// O(N log N)
+		void __fastcall		rotatePath(_ui nodeId);																			// O(log N)
+		_b   __fastcall		rotateNode(_ui nodeId);																			// O(1)
+		void __fastcall		rotateChild(_ui nodeId, _ui childAId, _ui childBId);											// O(1)
+		void __fastcall		updateDistance(_ui nodeId);																		// O(log N)
+
+		void __fastcall		orderDFS(_ui nodeId, _ui* pOrder, _ui& numOrder) const;											// O(N)
+		void __fastcall		orderVEB(_ui nodeId, _ui numLevels, _ui* pOrder, _ui& numOrder) const;							// O(N log log N)
+		void __fastcall		orderVEBBottom(_ui nodeId, _ui depth, _ui numLevels, _ui* pOrder, _ui& numOrder) const;			// O(N log log N)
+
+		void __fastcall		select(Key* pKey, _ui iLo, _ui iHi, _ui iNth, _ui axis);										// O(N)
+
+		_ui  __fastcall		sort(Key* pKey, _ui iLo, _ui iHi, _ui level, _ui numThreads);									// O(N log N)
+		void __fastcall		sortTask(Key* pKey, _ui iLo, _ui iHi, _ui level, _ui numThreads);								// O(N log N)
+		_ui  __fastcall		branchId(const Key* pKey, _ui iLo, _ui iHi) const;												// O(1)
+
+		void __fastcall		linkNode(_ui nodeId, _ui nodeLId, _ui nodeRId, _ui level);										// O(1)
+		_ui  __fastcall		splitSAH(SAH& sah, _ui iLo, _ui iHi) const;														// O(N)
+		_ui  __fastcall		binSAH(const SAH& sah, const type& avg, const type& lo, const type& scale) const;				// O(1)
+		_ui  __fastcall		sortSAH(SAH& sah, _ui iLo, _ui iHi, _ui level);													// O(N log N)
+		void __fastcall		orderChildren(_ui nodeId);																		// O(1)
+
+		MortonCode __fastcall	mortonCode(const Vec3<type>& avg, const LBVH& lbvh) const;									// O(1)
+		MortonCode __fastcall	mortonSplit(MortonCode v) const;															// O(1)
+		_ui  __fastcall		leadingZeros(MortonCode v) const;																// O(1)
+		_i   __fastcall		mortonDelta(const LBVH& lbvh, _i i, _i j) const;												// O(1)
+		void __fastcall		mortonRange(LBVH& lbvh, _ui iLo, _ui iHi);														// O(N)
+		void __fastcall		radixSort(LBVH& lbvh) const;																	// O(N)
+		void __fastcall		linkRange(LBVH& lbvh, _ui iLo, _ui iHi);														// O(N log N)
+		template <class task>
+		void __fastcall		parallel(task& t, _ui num, _ui numThreads, void (BVH3::*func)(task& t, _ui iLo, _ui iHi));	// O(1)
+		template <class task>
+		void __fastcall		parallel(task& t, _ui num, _ui numThreads, void (BVH3::*func)(task& t, _ui iLo, _ui iHi) const) const;	// O(1)
+		void __fastcall		updateTree(_ui nodeId);																			// O(N)
 
 		void __fastcall		update(_ui nodeId);																				// O(N log N)
 
-		_b   __fastcall		intersection(const Node& node, _ui nodeId) const;												// O(1)
-
-		_b   __fastcall		check(const Elem& elem, _ui nodeId, _b& bIntersection, _b bOneIntersection, _b bSubAvg,			// O(N log N)
-									callBack& callBackClass, callBackIntersectionFunc intersectionFunc) const;
+		_b   __fastcall		intersection(const Elem& elem, _ui nodeId, _b bSubAvg) const;									// O(1)
+		_b   __fastcall		intersectionRay(const Vec3<type>& origin, const Vec3<type>& invDir, const type& t, _ui nodeId, type& tNear) const;	// O(1)
+		type __fastcall		distance2(const Vec3<type>& dot, _ui nodeId, callBack& callBackClass, callBackDistanceFunc distanceFunc) const;	// O(1)
+		_b   __fastcall		intersectionSweep(const AABB3<type>& aabbSwept, const AABB3<type>& aabb, const Vec3<type>& invVec, _ui nodeId, Sweep& sweep) const;	// O(1)
+		void __fastcall		sweepDown(Sweep* pSweep, _ui numSweeps, _ui i) const;											// O(log N)
+		_ui  __fastcall		cull(const Volume& volume, _ui mask, _ui* pNodeId, _ui numNodeIdsMax) const;					// O(N)
+		_b   __fastcall		intersectionVolume(const Volume& volume, const AABB3<type>& aabb, _ui& mask) const;				// O(1)
+		_b   __fastcall		heapPush(Heap& heap, _ui nodeId, const type& dist2) const;										// O(log N)
+		Near __fastcall		heapPop(Heap& heap) const;																		// O(log N)
+		_ui  __fastcall		intersectionPacket(const Packet& packet, const AABB3<type>& aabb, _ui mask) const;				// O(1)
+		_ui  __fastcall		intersectionQuery(const Query& query, const AABB3<type>& aabb, _ui mask, _b bSubAvg) const;		// O(1)
+		void __fastcall		checkQuery(const Query& query, _ui numQueries, _b bSubAvg, HitBuffer& hits) const;				// O(N log N)
+		void __fastcall		checkRange(Batch& batch, _ui iLo, _ui iHi) const;												// O(N log N)
+		void __fastcall		addHit(HitBuffer& hits, _ui queryId, _ui nodeId) const;											// O(1)
+		_ui  __fastcall		castPacket(const Vec3<type>* pOrigin, const Vec3<type>* pDir, type* pT, _ui* pNodeHitId, _ui numRays, _b bAnyHit,	// O(N log N)
+										callBack& callBackClass, callBackCastFunc castFunc) const;
 
 		_b   __fastcall		update(_ui nodeId, callBack& callBackClass, callBackUpdateFunc updateFunc);						// O(N log N)
+		_b   __fastcall		updateLeaf(_ui nodeId, callBack& callBackClass, callBackUpdateFunc updateFunc);					// O(1)
+		_b   __fastcall		updateLeafElem(_ui nodeId, callBack& callBackClass, callBackUpdateFunc updateFunc);				// O(1)
+		void __fastcall		refitRange(Refit& refit, _ui iLo, _ui iHi);														// O(N)
+
+		_b   __fastcall		refitLeaf(_ui nodeId, callBack& callBackClass, callBackUpdateFunc updateFunc);					// O(1)
+		_b   __fastcall		refitNode(_ui nodeId, _ui& numRefit);															// O(M log N)
 	};
 
 
@@ -154,6 +478,14 @@ namespace Mpe
 
 	template <class callBack, typename type, typename data> BVH3<callBack, type, data>::BVH3(_ui numNodesMax)
 	{
+		reset();
+		init(numNodesMax);
+	}
+
+	template <class callBack, typename type, typename data> BVH3<callBack, type, data>::BVH3(_ui numNodesMax, const Allocator& alloc)
+	{
+		reset();
+		_allocator = alloc;
 		init(numNodesMax);
 	}
 
@@ -167,23 +499,31 @@ namespace Mpe
 	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::init(_ui numNodesMax)
 	{
 		flush();
-		try
-		{
-			_pNode		= new Node[numNodesMax];
-			_pFreeNode	= new _ui[numNodesMax];
-		}
-		catch(...)
+		_pNode			= _allocator.create<Node>(numNodesMax);
+		_pHot			= _allocator.create<Hot>(numNodesMax);
+		_pFreeNode		= _allocator.create<_ui>(numNodesMax);
+		_numNodesMax	= numNodesMax;
+		if (!_pNode || !_pHot || !_pFreeNode)
 		{
 			flush();
 			return false;
 		}
 		for (_ui id = 0; id<numNodesMax; id++)
-			_pNode[id].uid = id;
-		_numNodesMax	= numNodesMax;
+		{
+			_pNode[id].uid		= id;
+			_pNode[id].bRefit	= false;
+		}
 		_numFreeNodes	= 0;
 		return true;
 	}
 
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::allocator(const Allocator& alloc)
+	{
+		if (_pNode) return false;
+		_allocator = alloc;
+		return true;
+	}
+
 
 	
 	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::numNodesMax(void) const
@@ -201,11 +541,30 @@ namespace Mpe
 		return _numFreeNodes;
 	}
 
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::reserve(_ui numNodesMax)
+	{
+		if (_bView) return false;
+		if (numNodesMax<=_numNodesMax) return true;
+		return relocate(numNodesMax);
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::shrinkToFit(void)
+	{
+		if (_bView) return false;
+		if (_numNodes==_numNodesMax) return true;
+		return relocate(_numNodes);
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::numNodesBuild(_ui numElements)
+	{
+		return numElements ? numElements*2-1 : 0;
+	}
+
 
 
 	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::define(const Elem* pElem, _ui numElements)
 	{
-		if (numElements>=_numNodesMax) return false;
+		if (!reserve(numNodesBuild(numElements))) return false;
 		for (_ui id = 0; id<numElements; id++)
 			if (push(pElem[id])>=_numNodesMax) return false;
 		_numNodes = numElements;
@@ -216,54 +575,174 @@ namespace Mpe
 
 	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::push(const Elem& elem)
 	{
-		if (_numNodes>=_numNodesMax) return _numNodesMax;
+		if (_bView) return _numNodesMax;
+		if (_numNodes>=_numNodesMax && !grow(_numNodes+1)) return _numNodesMax;
 		const _ui nodeId = _numNodes;
 		Node& node = _pNode[nodeId];
-		node.elem					= elem;
+		setLeaf(nodeId, elem, Vec3<type>((const type)0));
 		node.parentId				= _numNodesMax;
-		node.childId[s_childLId]	= _numNodesMax;
-		node.childId[s_childRId]	= _numNodesMax;
+		_pHot[nodeId].childId[s_childLId]	= _numNodesMax;
+		_pHot[nodeId].childId[s_childRId]	= _numNodesMax;
 		node.level					= 0;
 		node.maxLeafDistance		= 0;
 		node.parentChildId			= _numNodesMax;
 		node.numAvg					= 1;
-		node.elem.aabbAvg			= node.elem.avg;
 		_numNodes++;
 		return nodeId;
 	}
 	
 	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::build(void)
 	{
-		_ui uid = 0;
-		for (_ui nodeId = 0; nodeId<_numNodes; nodeId++)
-			_pNode[nodeId].uid = _pNode[nodeId].maxLeafDistance==0 ? uid++ : _numNodesMax;
-		const _ui numNodes = uid;
-		const _ui numNodesMax = _numNodes * (_ui)(Math::log<_d>((_d)_numNodes,(_d)2));
-		if (numNodesMax>_numNodesMax) return false;
-		_rootNodeId = sort(0, numNodes-1, 0);
-		if (_rootNodeId>=_numNodesMax) return false;
-		sortByUid(0, numNodes-1);
+		return build(1);
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::build(_ui numThreads)
+	{
+		if (_bView) return false;
+		const _ui numNodes = gatherLeaves();
+		if (!numNodes) return false;
+		if (!reserve(numNodesBuild(numNodes))) return false;
+		// leaves are split by keys of averages and stay on their places
+		Key* pKey = NULL;
+		try
+		{
+			pKey = new Key[numNodes];
+		}
+		catch(...)
+		{
+			return false;
+		}
+		for (_ui nodeId = 0; nodeId<numNodes; nodeId++)
+		{
+			pKey[nodeId].avg	= _pNode[nodeId].elem.avg;
+			pKey[nodeId].nodeId	= nodeId;
+		}
+		// branch nodes are placed after leaves by split index, so every branch owns its range of nodes
+		_rootNodeId = sort(pKey, 0, numNodes-1, 0, numThreads);
+		_numNodes		= numNodes*2-1;
+		_numFreeNodes	= 0;
+		Node& nodeR = _pNode[_rootNodeId];
+		nodeR.parentId		= _numNodesMax;
+		nodeR.parentChildId	= _numNodesMax;
+		_bAvgOrder	= true;
+		_bLevelLazy	= false;
+		try	{	delete[] pKey;	}	catch(...)	{};
+		return true;
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::buildSAH(_ui numBins)
+	{
+		if (_bView) return false;
+		const _ui numLeaves = gatherLeaves();
+		if (!numLeaves) return false;
+		if (!reserve(numNodesBuild(numLeaves))) return false;
+		SAH sah;
+		sah.pIndex	= NULL;
+		sah.pBin	= NULL;
+		sah.pArea	= NULL;
+		sah.numBins	= Math::min<_ui>(Math::max<_ui>(numBins, s_numBinsMin), s_numBinsMax);
+		try
+		{
+			sah.pIndex	= new _ui[numLeaves];
+			sah.pBin	= new Bin[sah.numBins];
+			sah.pArea	= new type[sah.numBins];
+		}
+		catch(...)
+		{
+			try	{	delete[] sah.pIndex;	}	catch(...)	{};
+			try	{	delete[] sah.pBin;		}	catch(...)	{};
+			return false;
+		}
+		for (_ui i = 0; i<numLeaves; i++)
+			sah.pIndex[i] = i;
+		_rootNodeId = sortSAH(sah, 0, numLeaves-1, 0);
+		Node& nodeR = _pNode[_rootNodeId];
+		nodeR.parentId		= _numNodesMax;
+		nodeR.parentChildId	= _numNodesMax;
+		_numFreeNodes		= 0;
+		_bAvgOrder			= false;
+		_bLevelLazy			= false;
+		try	{	delete[] sah.pIndex;	}	catch(...)	{};
+		try	{	delete[] sah.pBin;		}	catch(...)	{};
+		try	{	delete[] sah.pArea;		}	catch(...)	{};
+		return true;
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::buildLinear(_b bWideCode, _ui numThreads)
+	{
+		if (_bView) return false;
+		const _ui numLeaves = gatherLeaves();
+		if (!numLeaves) return false;
+		if (!reserve(numNodesBuild(numLeaves))) return false;
+		LBVH lbvh;
+		lbvh.pCode		= NULL;
+		lbvh.pCodeTmp	= NULL;
+		lbvh.pIndex		= NULL;
+		lbvh.pIndexTmp	= NULL;
+		lbvh.numLeaves	= numLeaves;
+		lbvh.numBits	= bWideCode ? s_numCodeBitsW : s_numCodeBits;
+		try
+		{
+			lbvh.pCode		= new MortonCode[numLeaves];
+			lbvh.pCodeTmp	= new MortonCode[numLeaves];
+			lbvh.pIndex		= new _ui[numLeaves];
+			lbvh.pIndexTmp	= new _ui[numLeaves];
+		}
+		catch(...)
+		{
+			try	{	delete[] lbvh.pCode;		}	catch(...)	{};
+			try	{	delete[] lbvh.pCodeTmp;		}	catch(...)	{};
+			try	{	delete[] lbvh.pIndex;		}	catch(...)	{};
+			return false;
+		}
+		// codes of leaves averages
+		lbvh.aabbAvg = _pNode[0].elem.avg;
+		for (_ui nodeId = 1; nodeId<numLeaves; nodeId++)
+			lbvh.aabbAvg.expand(_pNode[nodeId].elem.avg);
+		parallel(lbvh, numLeaves, numThreads, &BVH3::mortonRange);
+		radixSort(lbvh);
+		// branch nodes are placed after leaves, branch node 0 is root
+		parallel(lbvh, numLeaves-1, numThreads, &BVH3::linkRange);
+		_numNodes		= numLeaves*2-1;
+		_numFreeNodes	= 0;
+		_bAvgOrder		= false;
+		_bLevelLazy		= false;
+		_rootNodeId		= numLeaves>1 ? numLeaves : 0;
+		Node& nodeR = _pNode[_rootNodeId];
+		nodeR.parentId		= _numNodesMax;
+		nodeR.parentChildId	= _numNodesMax;
+		nodeR.level			= 0;
+		updateChildren(_rootNodeId);
+		updateTree(_rootNodeId);
+		try	{	delete[] lbvh.pCode;		}	catch(...)	{};
+		try	{	delete[] lbvh.pCodeTmp;		}	catch(...)	{};
+		try	{	delete[] lbvh.pIndex;		}	catch(...)	{};
+		try	{	delete[] lbvh.pIndexTmp;	}	catch(...)	{};
 		return true;
 	}
 	
 	
 	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::add(const Elem& elem)
 	{
+		if (_bView) return _numNodesMax;
+		// references to nodes are taken after storage is grown for up to two new nodes
+		if (_numNodes+2>=_numNodesMax && !grow(_numNodes+3)) return _numNodesMax;
 		// set root node
 		if (!_numNodes)
 		{
 			Node& node = _pNode[0];
-			node.elem					= elem;
+			setLeaf(0, elem, Vec3<type>((const type)0));
 			node.parentId				= _numNodesMax;
-			node.childId[s_childLId]	= _numNodesMax;
-			node.childId[s_childRId]	= _numNodesMax;
+			_pHot[0].childId[s_childLId]	= _numNodesMax;
+			_pHot[0].childId[s_childRId]	= _numNodesMax;
 			node.level					= 0;
 			node.maxLeafDistance		= 0;
 			node.parentChildId			= _numNodesMax;
 			node.numAvg					= 1;
-			node.elem.aabbAvg			= node.elem.avg;
 			_numNodes++;
 			_rootNodeId = 0;
+			_bAvgOrder	= true;
+			_bLevelLazy	= false;
 			return _rootNodeId;
 		}
 		// set branch or leaf node
@@ -278,6 +757,7 @@ namespace Mpe
 
 	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::del(_ui nodeId)
 	{
+		if (_bView) return false;
 		if (nodeId>=_numNodes) return false;
 		const Node& node = _pNode[nodeId];
 		if (node.maxLeafDistance>0) return false;
@@ -289,663 +769,2638 @@ namespace Mpe
 		if (nodeId>=_numNodes) return false;
 		const Node& node = _pNode[nodeId];
 		if (node.maxLeafDistance>0) return false;
-		Elem = node.elem;
+		elem = node.elem;
+		elem.aabb = node.aabbTight;
 		return true;
 	}
 
 	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::set(_ui nodeId, Elem& elem)
 	{
+		return set(nodeId, elem, Vec3<type>((const type)0));
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::set(_ui nodeId, Elem& elem, const Vec3<type>& vel)
+	{
+		if (_bView) return false;
 		if (nodeId>=_numNodes) return false;
-		const Node& node = _pNode[nodeId];
+		Node& node = _pNode[nodeId];
 		if (node.maxLeafDistance>0) return false;
+		// element is still inside of enlarged AABB, keep leaf on its place,
+		// average is kept too, so averages of ancestors and routing of searchLeaf stay valid
+		if (_bFat && node.elem.aabb.cover(elem.aabb))
+		{
+			const Vec3<type>  avg		= node.elem.avg;
+			const AABB3<type> aabb		= node.elem.aabb;
+			const AABB3<type> aabbAvg	= node.elem.aabbAvg;
+			node.elem			= elem;
+			node.elem.avg		= avg;
+			node.elem.aabb		= aabb;
+			node.elem.aabbAvg	= aabbAvg;
+			node.aabbTight		= elem.aabb;
+			return true;
+		}
+		setLeaf(nodeId, elem, vel);
 		const _ui nodeToId = searchLeaf(_rootNodeId, elem);
+		if (nodeToId==nodeId)
+		{
+			recalculate(node.parentId);
+			return true;
+		}
 		return moveLeaf(nodeId, nodeToId);
 	}
 	
 	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::check(const Elem& elem, _b bOneIntersection, _b bSubAvg, callBack& callBackClass, callBackIntersectionFunc intersectionFunc) const
 	{
-		_b bIntersection = false;
-		return check(elem, _rootNodeId, bIntersection, bOneIntersection, bSubAvg, callBackClass, intersectionFunc);
+		if (!_numNodes) return false;
+		// pending nodes are siblings of nodes of current path, so stack is never deeper than tree
+		_ui  stack[s_numStackNodes];
+		_ui* pStack = stack;
+		const _ui numStackNodesMax = _pNode[_rootNodeId].maxLeafDistance+1;
+		if (numStackNodesMax>s_numStackNodes)
+		{
+			try
+			{
+				pStack = new _ui[numStackNodesMax];
+			}
+			catch(...)
+			{
+				return false;
+			}
+		}
+		_b  bIntersection = false;
+		_ui numStackNodes = 0;
+		_ui nodeTId = intersection(elem, _rootNodeId, bSubAvg) ? _rootNodeId : _numNodesMax;
+		while (nodeTId<_numNodes || numStackNodes)
+		{
+			if (nodeTId>=_numNodes) nodeTId = pStack[--numStackNodes];
+			const Hot& hotT = _pHot[nodeTId];
+			if (hotT.childId[s_childLId]>=_numNodes)						// leaf node, intersection is checked already
+			{
+				bIntersection |= (callBackClass.*intersectionFunc)(elem, _pNode[nodeTId].elem);
+				if (bIntersection && bOneIntersection) break;
+				nodeTId = _numNodesMax;
+				continue;
+			}
+			// children are checked before pushing, one of them is visited next
+			const _ui nodeLId = hotT.childId[s_childLId];
+			const _ui nodeRId = hotT.childId[s_childRId];
+			const _b  bL = intersection(elem, nodeLId, bSubAvg);
+			const _b  bR = intersection(elem, nodeRId, bSubAvg);
+			if (bL && bR)
+			{
+				// child with larger overlap is more likely to have intersection for early out
+				_b bSwap = false;
+				if (bOneIntersection)
+					bSwap = elem.aabb.overlap(_pHot[nodeRId].aabb) > elem.aabb.overlap(_pHot[nodeLId].aabb);
+				pStack[numStackNodes++] = bSwap ? nodeLId : nodeRId;
+				nodeTId = bSwap ? nodeRId : nodeLId;
+			}
+			else if (bL)	nodeTId = nodeLId;
+			else if (bR)	nodeTId = nodeRId;
+			else			nodeTId = _numNodesMax;
+		}
+		if (pStack!=stack) try	{	delete[] pStack;	}	catch(...)	{};
+		return bIntersection;
 	}
 
-	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::exist(_ui nodeId) const
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::checkBatch(const Elem* pElem, _ui numElements, _b bSubAvg, Hit* pHit, _ui numHitsMax) const
 	{
-		return (nodeId<_numNodes && _pNode[nodeId].level!=_numNodesMax);
+		return checkBatch(pElem, numElements, bSubAvg, pHit, numHitsMax, 1, true);
 	}
 
-
-	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::update(callBack& callBackClass, callBackUpdateFunc updateFunc)
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::checkBatch(const Elem* pElem, _ui numElements, _b bSubAvg, Hit* pHit, _ui numHitsMax, _ui numThreads, _b bOrdered) const
 	{
-		if (!update(_rootNodeId, callBackClass, updateFunc)) return false;
-		update(_rootNodeId);
-		return true;
-	}
-
+		//
+		// close queries are grouped to packets by morton codes of their middles,
+		// every packet goes down the tree together, so nodes are loaded once per packet.
+		// packets are split to ranges of tasks, every task collects hits to its own buffer
+		//
 
-	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::verify(void) const
-	{
-		// check connections
-		for (_ui nodeTId = 0; nodeTId<_numNodes; nodeTId++)
+		if (!_numNodes || !numElements) return 0;
+		LBVH lbvh;
+		lbvh.pCode		= NULL;
+		lbvh.pCodeTmp	= NULL;
+		lbvh.pIndex		= NULL;
+		lbvh.pIndexTmp	= NULL;
+		lbvh.numLeaves	= numElements;
+		lbvh.numBits	= s_numCodeBits;
+		const _ui numPackets = (numElements + s_numPacketQueries-1) / s_numPacketQueries;
+		Batch batch;
+		batch.pElem			= pElem;
+		batch.numElements	= numElements;
+		batch.numTasks		= Math::max<_ui>(Math::min<_ui>(numThreads, numPackets), 1);
+		batch.bSubAvg		= bSubAvg;
+		batch.bOrdered		= bOrdered || batch.numTasks==1;
+		batch.pBuffer		= NULL;
+		batch.hits.pHit			= pHit;
+		batch.hits.numHits		= 0;
+		batch.hits.numHitsMax	= numHitsMax;
+		batch.hits.bGrow		= false;
+		batch.hits.bLost		= false;
+		batch.numHits		= 0;
+		try
 		{
-			if (!exist(nodeTId)) continue;
-			const Node& nodeT = _pNode[nodeTId];
-			const _ui nodePId = nodeT.parentId;
-			const _ui nodeLId = nodeT.childId[s_childLId];
-			const _ui nodeRId = nodeT.childId[s_childRId];
-			if (exist(nodePId) && _pNode[nodePId].childId[nodeT.parentChildId]!=nodeTId)
+			lbvh.pCode		= new MortonCode[numElements];
+			lbvh.pCodeTmp	= new MortonCode[numElements];
+			lbvh.pIndex		= new _ui[numElements];
+			lbvh.pIndexTmp	= new _ui[numElements];
+			batch.pBuffer	= new HitBuffer[batch.numTasks];
+		}
+		catch(...)
+		{
+			try	{	delete[] lbvh.pCode;		}	catch(...)	{};
+			try	{	delete[] lbvh.pCodeTmp;		}	catch(...)	{};
+			try	{	delete[] lbvh.pIndex;		}	catch(...)	{};
+			try	{	delete[] lbvh.pIndexTmp;	}	catch(...)	{};
+			return s_numHitsLost;
+		}
+		lbvh.aabbAvg = pElem[0].aabb.middle();
+		for (_ui i = 1; i<numElements; i++)
+			lbvh.aabbAvg.expand(pElem[i].aabb.middle());
+		for (_ui i = 0; i<numElements; i++)
+		{
+			lbvh.pIndex[i]	= i;
+			lbvh.pCode[i]	= mortonCode(pElem[i].aabb.middle(), lbvh);
+		}
+		radixSort(lbvh);
+		batch.pIndex = lbvh.pIndex;
+		// the only task writes to buffer of caller
+		for (_ui task = 0; task<batch.numTasks; task++)
+		{
+			HitBuffer& hits = batch.pBuffer[task];
+			hits.pHit		= NULL;
+			hits.numHits	= 0;
+			hits.numHitsMax	= 0;
+			hits.bGrow		= true;
+			hits.bLost		= false;
+		}
+		if (batch.numTasks==1) batch.pBuffer[0] = batch.hits;
+		parallel(batch, batch.numTasks, batch.numTasks, &BVH3::checkRange);
+		_ui numHits = batch.numTasks==1 ? batch.pBuffer[0].numHits : batch.numHits.load();
+		if (batch.numTasks>1 && batch.bOrdered)
+		{
+			// buffers are merged in order of tasks, the same order as of one task
+			numHits = 0;
+			for (_ui task = 0; task<batch.numTasks; task++)
 			{
-				return false;
+				const HitBuffer& hits = batch.pBuffer[task];
+				// hits over size of buffer of task are counted only (lost buffer could be NULL)
+				const _ui numHitsTask = Math::min<_ui>(hits.numHits, hits.numHitsMax);
+				for (_ui i = 0; i<numHitsTask && numHits+i<numHitsMax; i++)
+					pHit[numHits+i] = hits.pHit[i];
+				numHits += hits.numHits;
 			}
-			if (exist(nodeLId) && _pNode[nodeLId].parentId!=nodeTId)
+		}
+		_b bLost = false;
+		for (_ui task = 0; task<batch.numTasks; task++)
+		{
+			bLost |= batch.pBuffer[task].bLost;
+			if (batch.numTasks>1) try	{	delete[] batch.pBuffer[task].pHit;	}	catch(...)	{};
+		}
+		try	{	delete[] batch.pBuffer;		}	catch(...)	{};
+		try	{	delete[] lbvh.pCode;		}	catch(...)	{};
+		try	{	delete[] lbvh.pCodeTmp;		}	catch(...)	{};
+		try	{	delete[] lbvh.pIndex;		}	catch(...)	{};
+		try	{	delete[] lbvh.pIndexTmp;	}	catch(...)	{};
+		return bLost ? s_numHitsLost : numHits;
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::cast(const Vec3<type>& origin, const Vec3<type>& dir, type& t, _b bAnyHit, callBack& callBackClass, callBackCastFunc castFunc) const
+	{
+		//
+		// ray for t in [0..inf) or segment for t in [0..1], children are visited front-to-back,
+		// every confirmed hit shortens the ray, so farther nodes are skipped
+		//
+
+		if (!_numNodes) return _numNodesMax;
+		// axes parallel to ray have zero inversed direction
+		const Vec3<type> invDir(dir.x!=(const type)0 ? (const type)1/dir.x : (const type)0,
+								dir.y!=(const type)0 ? (const type)1/dir.y : (const type)0,
+								dir.z!=(const type)0 ? (const type)1/dir.z : (const type)0);
+		Cast  stack[s_numStackNodes];
+		Cast* pStack = stack;
+		const _ui numStackNodesMax = _pNode[_rootNodeId].maxLeafDistance+1;
+		if (numStackNodesMax>s_numStackNodes)
+		{
+			try
 			{
-				return false;
+				pStack = new Cast[numStackNodesMax];
 			}
-			if (exist(nodeRId) && _pNode[nodeRId].parentId!=nodeTId)
+			catch(...)
 			{
-				return false;
+				return _numNodesMax;
 			}
 		}
-		// check levels
-		for (_ui nodeTId = 0; nodeTId<_numNodes; nodeTId++)
+		_ui nodeHitId = _numNodesMax;
+		_ui numStackNodes = 0;
+		type tNear = (const type)0;
+		_ui nodeTId = intersectionRay(origin, invDir, t, _rootNodeId, tNear) ? _rootNodeId : _numNodesMax;
+		while (nodeTId<_numNodes || numStackNodes)
 		{
-			if (!exist(nodeTId)) continue;
-			const Node& nodeT = _pNode[nodeTId];
-			const _ui nodePId = nodeT.parentId;
-			if (nodePId==_numNodesMax)
+			if (nodeTId>=_numNodes)
 			{
-				if (nodeT.level!=0)
+				const Cast& cast = pStack[--numStackNodes];
+				if (cast.tNear>t) continue;									// behind of closest hit
+				nodeTId = cast.nodeId;
+			}
+			const Hot& hotT = _pHot[nodeTId];
+			if (hotT.childId[s_childLId]>=_numNodes)						// leaf node
+			{
+				if ((callBackClass.*castFunc)(origin, dir, t, _pNode[nodeTId].elem))
 				{
-					return false;
+					nodeHitId = nodeTId;
+					if (bAnyHit) break;
 				}
+				nodeTId = _numNodesMax;
 				continue;
 			}
-			const Node& nodeP = _pNode[nodePId];
-			if (nodeT.level!=nodeP.level+1)
+			// nearer child is visited next, farther one is pushed
+			const _ui nodeLId = hotT.childId[s_childLId];
+			const _ui nodeRId = hotT.childId[s_childRId];
+			type tNearL = (const type)0;
+			type tNearR = (const type)0;
+			const _b bL = intersectionRay(origin, invDir, t, nodeLId, tNearL);
+			const _b bR = intersectionRay(origin, invDir, t, nodeRId, tNearR);
+			if (bL && bR)
 			{
-				return false;
+				const _b bSwap = tNearR<tNearL;
+				pStack[numStackNodes].nodeId	= bSwap ? nodeLId : nodeRId;
+				pStack[numStackNodes].tNear		= bSwap ? tNearL  : tNearR;
+				numStackNodes++;
+				nodeTId = bSwap ? nodeRId : nodeLId;
 			}
+			else if (bL)	nodeTId = nodeLId;
+			else if (bR)	nodeTId = nodeRId;
+			else			nodeTId = _numNodesMax;
 		}
-		// check bounds
-		for (_ui nodeTId = 0; nodeTId<_numNodes; nodeTId++)
+		if (pStack!=stack) try	{	delete[] pStack;	}	catch(...)	{};
+		return nodeHitId;
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::cast(const Vec3<type>* pOrigin, const Vec3<type>* pDir, type* pT, _ui* pNodeHitId, _ui numRays, _b bAnyHit, callBack& callBackClass, callBackCastFunc castFunc) const
+	{
+		_ui numHits = 0;
+		for (_ui iLo = 0; iLo<numRays; iLo += s_numPacketRays)
 		{
-			if (!exist(nodeTId)) continue;
-			if (_pNode[nodeTId].maxLeafDistance!=0) continue;
-			_ui nodeCId = nodeTId;
-			_ui nodePId = _pNode[nodeCId].parentId;
-			while (nodePId<_numNodes)
+			const _ui num = Math::min<_ui>(numRays-iLo, s_numPacketRays);
+			// rays with the same direction octant are coherent, others are cast one by one
+			_b bCoherent = num>1;
+			for (_ui i = 1; i<num && bCoherent; i++)
 			{
-				if (!_pNode[nodePId].elem.aabb.cover(_pNode[nodeCId].elem.aabb))
-				{
-					return false;
-				}
-				nodeCId = nodePId;
-				nodePId = _pNode[nodeCId].parentId;
+				const Vec3<type>& d0 = pDir[iLo];
+				const Vec3<type>& di = pDir[iLo+i];
+				bCoherent = (d0.x<(const type)0)==(di.x<(const type)0) && (d0.y<(const type)0)==(di.y<(const type)0) && (d0.z<(const type)0)==(di.z<(const type)0);
+			}
+			if (bCoherent)
+			{
+				numHits += castPacket(pOrigin+iLo, pDir+iLo, pT+iLo, pNodeHitId+iLo, num, bAnyHit, callBackClass, castFunc);
+				continue;
+			}
+			for (_ui i = iLo; i<iLo+num; i++)
+			{
+				pNodeHitId[i] = cast(pOrigin[i], pDir[i], pT[i], bAnyHit, callBackClass, castFunc);
+				if (pNodeHitId[i]<_numNodesMax) numHits++;
 			}
 		}
-		return true;
+		return numHits;
 	}
 
-
-
-
-	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::reset(void)
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::nearest(const Vec3<type>& dot, const type& dist2Max, Near* pNear, _ui numNearMax, callBack& callBackClass, callBackDistanceFunc distanceFunc) const
 	{
-		_pNode			= NULL;
-		_pFreeNode		= NULL;
-		_numNodes		= 0;
-		_numFreeNodes	= 0;
-		_numNodesMax	= 0;
-		_rootNodeId		= 0;
-	}
+		//
+		// best-first search, queue holds branches by distance to their AABB and leaves by distance to their elements,
+		// leaf on top of queue is nearer than anything else left, so leaves come out in order of distance
+		//
 
-	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::flush(void)
+		if (!_numNodes || !numNearMax) return 0;
+		Near nearLocal[s_numStackNodes];
+		Heap heap;
+		heap.pNear		= nearLocal;
+		heap.numNear	= 0;
+		heap.numNearMax	= s_numStackNodes;
+		heap.bOwn		= false;
+		_ui numNear = 0;
+		_b  bLost	= false;												// queue couldn't grow, result would be incomplete
+		Near nearT;
+		nearT.nodeId	= _rootNodeId;
+		nearT.dist2		= distance2(dot, _rootNodeId, callBackClass, distanceFunc);
+		while (numNear<numNearMax)
+		{
+			if (nearT.dist2>dist2Max) break;								// the rest is farther
+			const Hot& hotT = _pHot[nearT.nodeId];
+			if (hotT.childId[s_childLId]>=_numNodes)						// leaf node
+			{
+				pNear[numNear++] = nearT;
+				if (!heap.numNear) break;
+				nearT = heapPop(heap);
+				continue;
+			}
+			// nearer child is visited next without queue when nothing in queue is nearer
+			const _ui nodeLId = hotT.childId[s_childLId];
+			const _ui nodeRId = hotT.childId[s_childRId];
+			const type dist2L = distance2(dot, nodeLId, callBackClass, distanceFunc);
+			const type dist2R = distance2(dot, nodeRId, callBackClass, distanceFunc);
+			const _b bRNear = dist2R<dist2L;
+			Near nearN, nearF;
+			nearN.nodeId	= bRNear ? nodeRId : nodeLId;
+			nearN.dist2		= bRNear ? dist2R : dist2L;
+			nearF.nodeId	= bRNear ? nodeLId : nodeRId;
+			nearF.dist2		= bRNear ? dist2L : dist2R;
+			if (nearF.dist2<=dist2Max && !heapPush(heap, nearF.nodeId, nearF.dist2))
+			{
+				bLost = true;
+				break;
+			}
+			if (heap.numNear && heap.pNear[0].dist2<nearN.dist2)
+			{
+				if (nearN.dist2<=dist2Max && !heapPush(heap, nearN.nodeId, nearN.dist2))
+				{
+					bLost = true;
+					break;
+				}
+				nearT = heapPop(heap);
+				continue;
+			}
+			nearT = nearN;
+		}
+		if (heap.bOwn) try	{	delete[] heap.pNear;	}	catch(...)	{};
+		return bLost ? _numNodesMax : numNear;
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::radius(const Vec3<type>& dot, const type& dist2Max, Near* pNear, _ui numNearMax, callBack& callBackClass, callBackDistanceFunc distanceFunc) const
+	{
+		if (!_numNodes) return 0;
+		_ui  stack[s_numStackNodes];
+		_ui* pStack = stack;
+		const _ui numStackNodesMax = _pNode[_rootNodeId].maxLeafDistance+1;
+		if (numStackNodesMax>s_numStackNodes)
+		{
+			try
+			{
+				pStack = new _ui[numStackNodesMax];
+			}
+			catch(...)
+			{
+				return 0;
+			}
+		}
+		_ui numNear = 0;
+		_ui numStackNodes = 0;
+		pStack[numStackNodes++] = _rootNodeId;
+		while (numStackNodes)
+		{
+			const _ui nodeTId = pStack[--numStackNodes];
+			const Hot& hotT = _pHot[nodeTId];
+			const type dist2 = distance2(dot, nodeTId, callBackClass, distanceFunc);
+			if (dist2>dist2Max) continue;
+			if (hotT.childId[s_childLId]<_numNodes)							// branch node
+			{
+				pStack[numStackNodes++] = hotT.childId[s_childRId];
+				pStack[numStackNodes++] = hotT.childId[s_childLId];
+				continue;
+			}
+			if (numNear<numNearMax)											// leaf node
+			{
+				pNear[numNear].nodeId	= nodeTId;
+				pNear[numNear].dist2	= dist2;
+			}
+			numNear++;
+		}
+		if (pStack!=stack) try	{	delete[] pStack;	}	catch(...)	{};
+		return numNear;
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::sweep(const AABB3<type>& aabb, const Vec3<type>& vec, Sweep* pSweep, _ui numSweepsMax) const
+	{
+		//
+		// nodes are pruned by AABB of whole movement and then by time interval of contact,
+		// when output is full it's kept as heap by latest entry, nodes entered not before it are skipped,
+		// at the end heap is sorted in place
+		//
+
+		if (!_numNodes || !numSweepsMax) return 0;
+		AABB3<type> aabbSwept(aabb);
+		aabbSwept.extend(vec);
+		// axes without movement have zero inversed vector
+		const Vec3<type> invVec(vec.x!=(const type)0 ? (const type)1/vec.x : (const type)0,
+								vec.y!=(const type)0 ? (const type)1/vec.y : (const type)0,
+								vec.z!=(const type)0 ? (const type)1/vec.z : (const type)0);
+		Sweep  stack[s_numStackNodes];
+		Sweep* pStack = stack;
+		const _ui numStackNodesMax = _pNode[_rootNodeId].maxLeafDistance+1;
+		if (numStackNodesMax>s_numStackNodes)
+		{
+			try
+			{
+				pStack = new Sweep[numStackNodesMax];
+			}
+			catch(...)
+			{
+				return 0;
+			}
+		}
+		_ui numSweeps = 0;
+		_ui numStackNodes = 0;
+		if (intersectionSweep(aabbSwept, aabb, invVec, _rootNodeId, pStack[numStackNodes])) numStackNodes++;
+		while (numStackNodes)
+		{
+			const Sweep sweepT = pStack[--numStackNodes];
+			if (numSweeps==numSweepsMax && sweepT.tEnter>=pSweep[0].tEnter) continue;	// all leaves of node enter later
+			const Hot& hotT = _pHot[sweepT.nodeId];
+			if (hotT.childId[s_childLId]>=_numNodes)						// leaf node
+			{
+				if (numSweeps<numSweepsMax)
+				{
+					pSweep[numSweeps++] = sweepT;
+					if (numSweeps==numSweepsMax)
+						for (_ui i = numSweeps/2; i>0; i--)
+							sweepDown(pSweep, numSweeps, i-1);
+					continue;
+				}
+				pSweep[0] = sweepT;
+				sweepDown(pSweep, numSweeps, 0);
+				continue;
+			}
+			// children are checked before pushing, child entered earlier is visited first
+			Sweep sweepL, sweepR;
+			const _b bL = intersectionSweep(aabbSwept, aabb, invVec, hotT.childId[s_childLId], sweepL);
+			const _b bR = intersectionSweep(aabbSwept, aabb, invVec, hotT.childId[s_childRId], sweepR);
+			if (bL && bR)
+			{
+				const _b bSwap = sweepR.tEnter<sweepL.tEnter;
+				pStack[numStackNodes++] = bSwap ? sweepL : sweepR;
+				pStack[numStackNodes++] = bSwap ? sweepR : sweepL;
+			}
+			else if (bL)	pStack[numStackNodes++] = sweepL;
+			else if (bR)	pStack[numStackNodes++] = sweepR;
+		}
+		if (pStack!=stack) try	{	delete[] pStack;	}	catch(...)	{};
+		// heap sort
+		if (numSweeps<numSweepsMax)
+			for (_ui i = numSweeps/2; i>0; i--)
+				sweepDown(pSweep, numSweeps, i-1);
+		for (_ui i = numSweeps; i>1; i--)
+		{
+			const Sweep sweepT = pSweep[0];
+			pSweep[0] = pSweep[i-1];
+			pSweep[i-1] = sweepT;
+			sweepDown(pSweep, i-1, 0);
+		}
+		return numSweeps;
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::sphere(const Vec3<type>& center, const type& radius, _ui* pNodeId, _ui numNodeIdsMax) const
+	{
+		Volume volume;
+		volume.volumeType	= s_volumeSphere;
+		volume.center		= center;
+		volume.radius2		= radius*radius;
+		volume.pPlane		= NULL;
+		volume.pOBB			= NULL;
+		return cull(volume, 1, pNodeId, numNodeIdsMax);
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::halfSpace(const Plane& plane, _ui* pNodeId, _ui numNodeIdsMax) const
+	{
+		return frustum(&plane, 1, pNodeId, numNodeIdsMax);
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::frustum(const Plane* pPlane, _ui numPlanes, _ui* pNodeId, _ui numNodeIdsMax) const
+	{
+		if (numPlanes>s_numCullPlanes) return 0;
+		Volume volume;
+		volume.volumeType	= s_volumePlanes;
+		volume.center		= (const type)0;
+		volume.radius2		= (const type)0;
+		volume.pPlane		= pPlane;
+		volume.pOBB			= NULL;
+		const _ui mask = numPlanes==s_numCullPlanes ? ~(_ui)0 : ((_ui)1<<numPlanes)-1;
+		return cull(volume, mask, pNodeId, numNodeIdsMax);
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::obb(const OBB& obb, _ui* pNodeId, _ui numNodeIdsMax) const
+	{
+		Volume volume;
+		volume.volumeType	= s_volumeOBB;
+		volume.center		= (const type)0;
+		volume.radius2		= (const type)0;
+		volume.pPlane		= NULL;
+		volume.pOBB			= &obb;
+		return cull(volume, 1, pNodeId, numNodeIdsMax);
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::pairs(Pair* pPair, _ui numPairsMax) const
+	{
+		return pairs(*this, pPair, numPairsMax);
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::pairs(const BVH3& bvh, Pair* pPair, _ui numPairsMax) const
+	{
+		//
+		// simultaneous descent of both trees, the larger node of pair is split.
+		// for the tree against itself pair with A==B stands for pairs inside of branch A,
+		// it's split to pairs inside of both children and pair of children, so every unordered pair is checked once
+		//
+
+		if (!_numNodes || !bvh._numNodes) return 0;
+		const _b bSelf = &bvh==this;
+		const Node* pNodeB = bvh._pNode;
+		const Hot*  pHotB  = bvh._pHot;
+		// every step is one level deeper for one of nodes and adds up to two pairs
+		const _ui numStackPairsMax = (_pNode[_rootNodeId].maxLeafDistance + pNodeB[bvh._rootNodeId].maxLeafDistance + 2)*2;
+		Pair* pStack = NULL;
+		try
+		{
+			pStack = new Pair[numStackPairsMax];
+		}
+		catch(...)
+		{
+			return 0;
+		}
+		_ui numPairs = 0;
+		_ui numStackPairs = 1;
+		pStack[0].nodeAId = _rootNodeId;
+		pStack[0].nodeBId = bvh._rootNodeId;
+		while (numStackPairs)
+		{
+			const Pair pair = pStack[--numStackPairs];
+			const Hot& hotA = _pHot[pair.nodeAId];
+			const Hot& hotB = pHotB[pair.nodeBId];
+			const _b bLeafA = hotA.childId[s_childLId]>=_numNodes;
+			const _b bLeafB = hotB.childId[s_childLId]>=bvh._numNodes;
+			if (bSelf && pair.nodeAId==pair.nodeBId)						// pairs inside of branch
+			{
+				if (bLeafA) continue;
+				const _ui nodeLId = hotA.childId[s_childLId];
+				const _ui nodeRId = hotA.childId[s_childRId];
+				pStack[numStackPairs].nodeAId	= nodeLId;	pStack[numStackPairs].nodeBId	= nodeLId;	numStackPairs++;
+				pStack[numStackPairs].nodeAId	= nodeRId;	pStack[numStackPairs].nodeBId	= nodeRId;	numStackPairs++;
+				pStack[numStackPairs].nodeAId	= nodeLId;	pStack[numStackPairs].nodeBId	= nodeRId;	numStackPairs++;
+				continue;
+			}
+			if (!hotA.aabb.intersect(hotB.aabb)) continue;
+			if (bLeafA && bLeafB)											// pair of leaves
+			{
+				if ((_bFat || bvh._bFat) && !_pNode[pair.nodeAId].aabbTight.intersect(pNodeB[pair.nodeBId].aabbTight)) continue;
+				if (numPairs<numPairsMax)
+				{
+					pPair[numPairs].nodeAId = pair.nodeAId;
+					pPair[numPairs].nodeBId = pair.nodeBId;
+				}
+				numPairs++;
+				continue;
+			}
+			// larger branch is split
+			if (!bLeafA && (bLeafB || hotA.aabb.area()>=hotB.aabb.area()))
+			{
+				pStack[numStackPairs].nodeAId	= hotA.childId[s_childLId];	pStack[numStackPairs].nodeBId	= pair.nodeBId;	numStackPairs++;
+				pStack[numStackPairs].nodeAId	= hotA.childId[s_childRId];	pStack[numStackPairs].nodeBId	= pair.nodeBId;	numStackPairs++;
+			}
+			else
+			{
+				pStack[numStackPairs].nodeAId	= pair.nodeAId;	pStack[numStackPairs].nodeBId	= hotB.childId[s_childLId];	numStackPairs++;
+				pStack[numStackPairs].nodeAId	= pair.nodeAId;	pStack[numStackPairs].nodeBId	= hotB.childId[s_childRId];	numStackPairs++;
+			}
+		}
+		try	{	delete[] pStack;	}	catch(...)	{};
+		return numPairs;
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::exist(_ui nodeId) const
+	{
+		return (nodeId<_numNodes && _pNode[nodeId].level!=_numNodesMax);
+	}
+
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::update(callBack& callBackClass, callBackUpdateFunc updateFunc)
+	{
+		if (_bView) return false;
+		if (!update(_rootNodeId, callBackClass, updateFunc)) return false;
+		update(_rootNodeId);
+		return true;
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::update(callBack& callBackClass, callBackUpdateFunc updateFunc, _ui numThreads)
+	{
+		if (_bView) return false;
+		if (!_numNodes) return false;
+		Refit refit;
+		refit.pArrival			= NULL;
+		refit.pCallBackClass	= &callBackClass;
+		refit.updateFunc		= updateFunc;
+		refit.bUpdate			= true;
+		try
+		{
+			refit.pArrival = new std::atomic<_ui>[_numNodes];
+		}
+		catch(...)
+		{
+			return false;
+		}
+		for (_ui nodeId = 0; nodeId<_numNodes; nodeId++)
+			refit.pArrival[nodeId].store(0, std::memory_order_relaxed);
+		// leaves are split into ranges of nodes, every leaf climbs to root while it is the second child arrived to node
+		parallel(refit, _numNodes, numThreads, &BVH3::refitRange);
+		try	{	delete[] refit.pArrival;	}	catch(...)	{};
+		return refit.bUpdate;
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::refit(const _ui* pNodeId, _ui numNodeIds, callBack& callBackClass, callBackUpdateFunc updateFunc)
+	{
+		if (_bView) return 0;
+		if (!pNodeId || !_numNodes) return 0;
+		// update leaves and mark union of paths of changed leaves up to root
+		_ui numRefit = 0;
+		_b  bChanged = false;
+		for (_ui i = 0; i<numNodeIds; i++)
+		{
+			const _ui nodeId = pNodeId[i];
+			if (!exist(nodeId)) continue;
+			Node& node = _pNode[nodeId];
+			if (node.maxLeafDistance!=0 || node.bRefit) continue;			// branch node or listed twice
+			numRefit++;
+			node.bRefit = true;
+			if (!refitLeaf(nodeId, callBackClass, updateFunc)) continue;
+			bChanged = true;
+			for (_ui nodePId = node.parentId; nodePId<_numNodes && !_pNode[nodePId].bRefit; nodePId = _pNode[nodePId].parentId)
+				_pNode[nodePId].bRefit = true;
+		}
+		// recalculate marked branches, unchanged children stop recalculation of their parents
+		if (bChanged) refitNode(_rootNodeId, numRefit);
+		// clear marks of listed leaves which were not changed
+		for (_ui i = 0; i<numNodeIds; i++)
+			if (pNodeId[i]<_numNodes) _pNode[pNodeId[i]].bRefit = false;
+		return numRefit;
+	}
+
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::verify(void) const
+	{
+		// check connections
+		for (_ui nodeTId = 0; nodeTId<_numNodes; nodeTId++)
+		{
+			if (!exist(nodeTId)) continue;
+			const Node& nodeT = _pNode[nodeTId];
+			const _ui nodePId = nodeT.parentId;
+			const _ui nodeLId = _pHot[nodeTId].childId[s_childLId];
+			const _ui nodeRId = _pHot[nodeTId].childId[s_childRId];
+			if (exist(nodePId) && _pHot[nodePId].childId[nodeT.parentChildId]!=nodeTId)
+			{
+				return false;
+			}
+			if (exist(nodeLId) && _pNode[nodeLId].parentId!=nodeTId)
+			{
+				return false;
+			}
+			if (exist(nodeRId) && _pNode[nodeRId].parentId!=nodeTId)
+			{
+				return false;
+			}
+		}
+		// check levels
+		for (_ui nodeTId = 0; nodeTId<_numNodes; nodeTId++)
+		{
+			if (!exist(nodeTId)) continue;
+			const Node& nodeT = _pNode[nodeTId];
+			const _ui nodePId = nodeT.parentId;
+			if (nodePId==_numNodesMax)
+			{
+				if (nodeT.level!=0)
+				{
+					return false;
+				}
+				continue;
+			}
+			const Node& nodeP = _pNode[nodePId];
+			if (!_bLevelLazy && nodeT.level!=nodeP.level+1)
+			{
+				return false;
+			}
+		}
+		// check bounds
+		for (_ui nodeTId = 0; nodeTId<_numNodes; nodeTId++)
+		{
+			if (!exist(nodeTId)) continue;
+			if (_pNode[nodeTId].maxLeafDistance!=0) continue;
+			if (!(_pHot[nodeTId].aabb==_pNode[nodeTId].elem.aabb))
+			{
+				return false;
+			}
+			_ui nodeCId = nodeTId;
+			_ui nodePId = _pNode[nodeCId].parentId;
+			while (nodePId<_numNodes)
+			{
+				if (!_pHot[nodePId].aabb.cover(_pHot[nodeCId].aabb))
+				{
+					return false;
+				}
+				nodeCId = nodePId;
+				nodePId = _pNode[nodeCId].parentId;
+			}
+		}
+		return true;
+	}
+
+
+
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::fat(_b bFat, const type& margin)
+	{
+		_bFat		= bFat;
+		_fatMargin	= margin;
+	}
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::rotation(_b bRotation)
+	{
+		_bRotation = bRotation;
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::optimize(_ui maxRotations)
+	{
+		if (_bView) return 0;
+		// one pass over all nodes at most, next call continues from the last visited node
+		_ui numRotations = 0;
+		for (_ui i = 0; i<_numNodes && numRotations<maxRotations; i++)
+		{
+			const _ui nodeId = _optimizeNodeId<_numNodes ? _optimizeNodeId : 0;
+			_optimizeNodeId = nodeId+1;
+			if (!exist(nodeId)) continue;
+			if (_pNode[nodeId].maxLeafDistance==0) continue;				// leaf node
+			if (!rotateNode(nodeId)) continue;
+			updateDistance(_pNode[nodeId].parentId);
+			numRotations++;
+		}
+		return numRotations;
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::compact(_b bVanEmdeBoas, _ui* pNodeIdNew)
+	{
+		//
+		// nodes are copied in order of traversal, so parent and its children are close in memory:
+		// depth first order places left child just after parent,
+		// van Emde Boas order places top half of levels first and then every bottom subtree in a row, at every scale.
+		// free nodes are dropped, root gets index 0
+		//
+
+		if (_bView) return false;
+		if (!_numNodes) return true;
+		const _ui numNodesOld = _numNodes;
+		_ui*  pOrder	= NULL;
+		_ui*  pNew		= NULL;
+		Node* pNode		= NULL;
+		Hot*  pHot		= NULL;
+		try
+		{
+			pOrder	= new _ui[numNodesOld];
+			pNew	= pNodeIdNew ? pNodeIdNew : new _ui[numNodesOld];
+			pNode	= _allocator.create<Node>(_numNodesMax);
+			pHot	= _allocator.create<Hot>(_numNodesMax);
+			if (!pNode || !pHot) throw 0;
+		}
+		catch(...)
+		{
+			try	{	delete[] pOrder;	}	catch(...)	{};
+			if (pNew!=pNodeIdNew) try	{	delete[] pNew;	}	catch(...)	{};
+			_allocator.destroy(pNode, _numNodesMax);
+			_allocator.destroy(pHot, _numNodesMax);
+			return false;
+		}
+		_ui numOrder = 0;
+		if (bVanEmdeBoas)	orderVEB(_rootNodeId, _pNode[_rootNodeId].maxLeafDistance+1, pOrder, numOrder);
+		else				orderDFS(_rootNodeId, pOrder, numOrder);
+		// van Emde Boas order relies on distance to leaves of root, tree is kept as it is if any node is missed
+		if (numOrder!=numNodesOld-_numFreeNodes)
+		{
+			try	{	delete[] pOrder;	}	catch(...)	{};
+			if (pNew!=pNodeIdNew) try	{	delete[] pNew;	}	catch(...)	{};
+			_allocator.destroy(pNode, _numNodesMax);
+			_allocator.destroy(pHot, _numNodesMax);
+			return false;
+		}
+		for (_ui nodeId = 0; nodeId<numNodesOld; nodeId++)
+			pNew[nodeId] = _numNodesMax;
+		for (_ui i = 0; i<numOrder; i++)
+			pNew[pOrder[i]] = i;
+		// links are renumbered, leaves keep no children
+		for (_ui i = 0; i<numOrder; i++)
+		{
+			const _ui nodeId = pOrder[i];
+			Node& node	= pNode[i];
+			Hot&  hot	= pHot[i];
+			node	= _pNode[nodeId];
+			hot		= _pHot[nodeId];
+			if (node.parentId<numNodesOld) node.parentId = pNew[node.parentId];
+			if (hot.childId[s_childLId]>=numNodesOld) continue;
+			hot.childId[s_childLId] = pNew[hot.childId[s_childLId]];
+			hot.childId[s_childRId] = pNew[hot.childId[s_childRId]];
+		}
+		for (_ui id = numOrder; id<_numNodesMax; id++)
+		{
+			pNode[id].uid		= id;
+			pNode[id].bRefit	= false;
+		}
+		_optimizeNodeId = _optimizeNodeId<numNodesOld && pNew[_optimizeNodeId]<numOrder ? pNew[_optimizeNodeId] : 0;
+		_allocator.destroy(_pNode, _numNodesMax);
+		_allocator.destroy(_pHot, _numNodesMax);
+		try	{	delete[] pOrder;	}	catch(...)	{};
+		if (pNew!=pNodeIdNew) try	{	delete[] pNew;	}	catch(...)	{};
+		_pNode			= pNode;
+		_pHot			= pHot;
+		_numNodes		= numOrder;
+		_numFreeNodes	= 0;
+		_rootNodeId		= 0;
+		return true;
+	}
+
+
+
+	//
+	// image is saved once (at asset bake) and used in place (from memory mapped file) without parsing or allocation:
+	//
+	//	 [ Image | Node * numNodes | Hot * numNodes | free node indices ]
+	//	 ^ every part begins at s_imageAlignment bytes boundary, parts are placed by offsets from begin of image
+	//
+	// links between nodes are indices and links to none are equal to number of nodes,
+	// so image doesn't depend on address it's mapped at. pData of elements is saved as NULL,
+	// elements are bound to holders by elemId. image is read by build with the same type, data and layout of nodes,
+	// other version, byte order or sizes are rejected by view.
+	//
+	//	 void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	//	 if (!bvh.view(p, size, bDebug)) ...			// queries of bvh read the mapped pages
+	//
+	template <class callBack, typename type, typename data> size_t __fastcall BVH3<callBack, type, data>::imageSize(void) const
+	{
+		const ImageSize sizeHeader	= imageAlign(sizeof(Image));
+		const ImageSize sizeNode	= imageAlign((ImageSize)sizeof(Node)*_numNodes);
+		const ImageSize sizeHot		= imageAlign((ImageSize)sizeof(Hot)*_numNodes);
+		const ImageSize sizeFree	= imageAlign((ImageSize)sizeof(_ui)*_numFreeNodes);
+		return (size_t)(sizeHeader + sizeNode + sizeHot + sizeFree);
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::save(void* pImage, size_t size) const
+	{
+		if (!pImage || (size_t)pImage%s_imageAlignment) return false;
+		const size_t sizeImage = imageSize();
+		if (size<sizeImage) return false;
+		char* pBegin = (char*)pImage;
+		memset(pBegin, 0, sizeImage);
+		Image& image = *(Image*)pBegin;
+		image.magic				= s_imageMagic;
+		image.version			= s_imageVersion;
+		image.sizeType			= sizeof(type);
+		image.sizeNode			= sizeof(Node);
+		image.sizeHot			= sizeof(Hot);
+		image.numNodes			= _numNodes;
+		image.numFreeNodes		= _numFreeNodes;
+		image.rootNodeId		= _rootNodeId;
+		image.optimizeNodeId	= _optimizeNodeId;
+		image.flags				= (_bAvgOrder ? s_imageAvgOrder : 0) | (_bFat ? s_imageFat : 0) | (_bRotation ? s_imageRotation : 0) | (_bLevelLazy ? s_imageLevelLazy : 0);
+		image.fatMargin			= _fatMargin;
+		image.offsetNode		= imageAlign(sizeof(Image));
+		image.offsetHot			= image.offsetNode + imageAlign((ImageSize)sizeof(Node)*_numNodes);
+		image.offsetFreeNode	= image.offsetHot + imageAlign((ImageSize)sizeof(Hot)*_numNodes);
+		image.size				= sizeImage;
+		Node* pNode		= (Node*)(pBegin + image.offsetNode);
+		Hot* pHot		= (Hot*)(pBegin + image.offsetHot);
+		_ui* pFreeNode	= (_ui*)(pBegin + image.offsetFreeNode);
+		// links to none are renumbered to number of nodes, as image keeps no unused nodes
+		for (_ui id = 0; id<_numNodes; id++)
+		{
+			Node& node	= pNode[id];
+			Hot& hot	= pHot[id];
+			node	= _pNode[id];
+			hot		= _pHot[id];
+			relink(node, hot, _numNodesMax, _numNodes);
+			node.elem.pData	= NULL;
+			node.bRefit		= false;
+		}
+		memcpy(pFreeNode, _pFreeNode, sizeof(_ui)*_numFreeNodes);
+		// header is checked too, checksum is zero yet
+		image.checksum = imageChecksum(pBegin, image.size, s_imageChecksumBasis);
+		return true;
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::view(const void* pImage, size_t size, _b bVerify)
+	{
+		if (!pImage || (size_t)pImage%s_imageAlignment) return false;
+		if (size<sizeof(Image)) return false;
+		const char* pBegin = (const char*)pImage;
+		const Image& image = *(const Image*)pBegin;
+		if (image.magic!=s_imageMagic) return false;
+		if (image.version!=s_imageVersion) return false;
+		if (image.sizeType!=sizeof(type) || image.sizeNode!=sizeof(Node) || image.sizeHot!=sizeof(Hot)) return false;
+		if (image.size>size) return false;
+		if (image.numFreeNodes>image.numNodes) return false;
+		if (image.numNodes && image.rootNodeId>=image.numNodes) return false;
+		if (image.offsetNode<sizeof(Image) || image.offsetNode+(ImageSize)sizeof(Node)*image.numNodes>image.offsetHot) return false;
+		if (image.offsetHot+(ImageSize)sizeof(Hot)*image.numNodes>image.offsetFreeNode) return false;
+		if (image.offsetFreeNode+(ImageSize)sizeof(_ui)*image.numFreeNodes>image.size) return false;
+		if (image.offsetNode%s_imageAlignment || image.offsetHot%s_imageAlignment || image.offsetFreeNode%s_imageAlignment) return false;
+		if (bVerify)
+		{
+			// copy of header with zero checksum is checked first, image itself is read only
+			Image header;
+			memcpy(&header, pBegin, sizeof(Image));
+			header.checksum = 0;
+			const ImageSize checksum = imageChecksum(&header, sizeof(Image), s_imageChecksumBasis);
+			if (imageChecksum(pBegin + sizeof(Image), image.size - sizeof(Image), checksum)!=image.checksum) return false;
+		}
+		flush();
+		// image is not written by view, all changing functions are rejected
+		_pNode			= (Node*)(pBegin + image.offsetNode);
+		_pHot			= (Hot*)(pBegin + image.offsetHot);
+		_pFreeNode		= (_ui*)(pBegin + image.offsetFreeNode);
+		_numNodes		= image.numNodes;
+		_numNodesMax	= image.numNodes;
+		_numFreeNodes	= image.numFreeNodes;
+		_rootNodeId		= image.rootNodeId;
+		_optimizeNodeId	= image.optimizeNodeId;
+		_bAvgOrder		= (image.flags & s_imageAvgOrder)!=0;
+		_bFat			= (image.flags & s_imageFat)!=0;
+		_bRotation		= (image.flags & s_imageRotation)!=0;
+		_bLevelLazy		= (image.flags & s_imageLevelLazy)!=0;
+		_fatMargin		= image.fatMargin;
+		_bView			= true;
+		if (bVerify && !verify())
+		{
+			flush();
+			return false;
+		}
+		return true;
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::readOnly(void) const
+	{
+		return _bView;
+	}
+
+
+
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::reset(void)
+	{
+		_pNode			= NULL;
+		_pHot			= NULL;
+		_pFreeNode		= NULL;
+		_numNodes		= 0;
+		_numFreeNodes	= 0;
+		_numNodesMax	= 0;
+		_rootNodeId		= 0;
+		_bAvgOrder		= true;
+		_bFat			= false;
+		_fatMargin		= (const type)0;
+		_bRotation		= false;
+		_bLevelLazy		= false;
+		_optimizeNodeId	= 0;
+		_bView			= false;
+	}
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::flush(void)
+	{
+		if (!_bView)
+		{
+			_allocator.destroy(_pNode, _numNodesMax);
+			_allocator.destroy(_pHot, _numNodesMax);
+			_allocator.destroy(_pFreeNode, _numNodesMax);
+		}
+		reset();
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::grow(_ui numNodesMin)
+	{
+		// geometric growth keeps push and add amortized O(1)
+		const _ui numNodesMax = _numNodesMax<((_ui)-1)/2 ? _numNodesMax*2 : (_ui)-1;
+		return relocate(Math::max<_ui>(Math::max<_ui>(numNodesMax, numNodesMin), s_numNodesGrow));
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::relocate(_ui numNodesMax)
+	{
+		// nodes are copied to new storage on their places, so indices held by caller stay valid,
+		// only links to none (equal to old maximal number of nodes) are renumbered to new maximal number of nodes
+		//
+		//	 old:	[ nodes 0.._numNodes-1 | unused ]                 none = old _numNodesMax
+		//	 new:	[ nodes 0.._numNodes-1 | unused ............... ] none = new _numNodesMax
+		//
+		if (numNodesMax<_numNodes) return false;
+		Node* pNode		= _allocator.create<Node>(numNodesMax);
+		Hot* pHot		= _allocator.create<Hot>(numNodesMax);
+		_ui* pFreeNode	= _allocator.create<_ui>(numNodesMax);
+		if (!pNode || !pHot || !pFreeNode)
+		{
+			_allocator.destroy(pNode, numNodesMax);
+			_allocator.destroy(pHot, numNodesMax);
+			_allocator.destroy(pFreeNode, numNodesMax);
+			return false;
+		}
+		const _ui nodeIdNone = _numNodesMax;
+		for (_ui id = 0; id<_numNodes; id++)
+		{
+			Node& node	= pNode[id];
+			Hot& hot	= pHot[id];
+			node		= _pNode[id];
+			hot			= _pHot[id];
+			relink(node, hot, nodeIdNone, numNodesMax);
+		}
+		for (_ui id = _numNodes; id<numNodesMax; id++)
+		{
+			pNode[id].uid		= id;
+			pNode[id].bRefit	= false;
+		}
+		for (_ui i = 0; i<_numFreeNodes; i++)
+			pFreeNode[i] = _pFreeNode[i];
+		_allocator.destroy(_pNode, _numNodesMax);
+		_allocator.destroy(_pHot, _numNodesMax);
+		_allocator.destroy(_pFreeNode, _numNodesMax);
+		_pNode			= pNode;
+		_pHot			= pHot;
+		_pFreeNode		= pFreeNode;
+		_numNodesMax	= numNodesMax;
+		return true;
+	}
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::relink(Node& node, Hot& hot, _ui nodeIdNone, _ui nodeIdNoneNew) const
+	{
+		if (node.parentId==nodeIdNone)				node.parentId				= nodeIdNoneNew;
+		if (node.parentChildId==nodeIdNone)			node.parentChildId			= nodeIdNoneNew;
+		if (node.level==nodeIdNone)					node.level					= nodeIdNoneNew;
+		if (node.uid==nodeIdNone)					node.uid					= nodeIdNoneNew;
+		if (hot.childId[s_childLId]==nodeIdNone)	hot.childId[s_childLId]	= nodeIdNoneNew;
+		if (hot.childId[s_childRId]==nodeIdNone)	hot.childId[s_childRId]	= nodeIdNoneNew;
+	}
+
+	template <class callBack, typename type, typename data> typename BVH3<callBack, type, data>::ImageSize __fastcall BVH3<callBack, type, data>::imageAlign(ImageSize size) const
+	{
+		return (size + s_imageAlignment - 1) / s_imageAlignment * s_imageAlignment;
+	}
+
+	template <class callBack, typename type, typename data> typename BVH3<callBack, type, data>::ImageSize __fastcall BVH3<callBack, type, data>::imageChecksum(const void* pImage, ImageSize size, ImageSize checksum) const
+	{
+		// FNV-1a by 64 bits words continued from checksum, parts of image are aligned, so size is multiple of words
+		const ImageSize* pWord = (const ImageSize*)pImage;
+		const ImageSize numWords = size / sizeof(ImageSize);
+		for (ImageSize i = 0; i<numWords; i++)
+			checksum = (checksum ^ pWord[i]) * 1099511628211ULL;
+		return checksum;
+	}
+
+
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::addNodeRaw(void)
+	{
+		return _numFreeNodes ? _pFreeNode[--_numFreeNodes] : _numNodes++;
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::gatherLeaves(void)
+	{
+		// leaves of built tree are moved to begin of nodes in order of their indices,
+		// branches and free nodes are dropped, so build works on pushed leaves and on built tree the same way
+		_ui numLeaves = 0;
+		for (_ui nodeId = 0; nodeId<_numNodes; nodeId++)
+		{
+			if (!exist(nodeId) || _pNode[nodeId].maxLeafDistance!=0) continue;
+			if (nodeId!=numLeaves)
+			{
+				_pNode[numLeaves]	= _pNode[nodeId];
+				_pHot[numLeaves]	= _pHot[nodeId];
+			}
+			Node& node = _pNode[numLeaves];
+			node.parentId						= _numNodesMax;
+			node.parentChildId					= _numNodesMax;
+			node.level							= 0;
+			node.uid							= numLeaves;
+			node.bRefit							= false;
+			_pHot[numLeaves].childId[s_childLId]	= _numNodesMax;
+			_pHot[numLeaves].childId[s_childRId]	= _numNodesMax;
+			numLeaves++;
+		}
+		_numNodes		= numLeaves;
+		_numFreeNodes	= 0;
+		_optimizeNodeId	= 0;
+		return numLeaves;
+	}
+	
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::setLeaf(_ui nodeId, const Elem& elem, const Vec3<type>& vel)
+	{
+		Node& node = _pNode[nodeId];
+		node.elem			= elem;
+		node.elem.aabbAvg	= elem.avg;
+		node.aabbTight		= elem.aabb;
+		if (_bFat)
+		{
+			node.elem.aabb += _fatMargin;
+			node.elem.aabb.extend(vel);
+		}
+		_pHot[nodeId].aabb = node.elem.aabb;
+	}
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::delNodeRaw(_ui nodeId)
+	{
+		if (nodeId<_numNodes-1)	_pFreeNode[_numFreeNodes++] = nodeId;
+		else					_numNodes--;
+		_pNode[nodeId].level = _numNodesMax;
+	}
+
+
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::getNeighborNode(_ui nodeId) const
+	{
+		const _ui nodePId = _pNode[nodeId].parentId;
+		const _ui parentNeighborChildId = (_pNode[nodeId].parentChildId + 1) % s_numChildren;
+		return _pHot[nodePId].childId[parentNeighborChildId];
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::getDownNode(_ui nodeId, _ui path, _ui depth) const
+	{
+		_ui nodeTId = nodeId;
+		for (_ui d = 0; d<depth, nodeTId<_numNodes; d++)
+		{
+			const _ui childId = (path & (1<<d));
+			nodeTId = _pHot[nodeTId].childId[childId];
+		}
+		return nodeTId;
+	}
+
+
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::axisIndex(_ui level) const
+	{
+		return (level % 3);
+	}
+
+	template <class callBack, typename type, typename data> type __fastcall BVH3<callBack, type, data>::getAxis(const Vec3<type>& vec, _ui axisId) const
+	{
+		const type v[3] = { vec.x, vec.y, vec.z };
+		return v[axisId];
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::switchAxis(const Vec3<type>& avgLeaf, const Vec3<type>& avgBranch, _ui level) const
+	{
+		const _ui axis = axisIndex(level);
+		const type avgL = getAxis(avgLeaf, axis);
+		const type avgB = getAxis(avgBranch, axis);
+		return avgL <= avgB ? 0 : 1;
+	}
+
+
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::searchLeaf(_ui nodeId, const Elem& elem) const
+	{
+		_ui nodeTId = nodeId;
+		for (_ui i = 0; i<_numNodes; i++)												// inf limited cycle
+		{
+			Node& nodeT = _pNode[nodeTId];
+			const _ui sideId = switchAxis(elem.avg, nodeT.elem.avg, nodeT.level);		// get child index side of node by average point of this node
+			if (nodeT.maxLeafDistance!=0)	nodeTId = _pHot[nodeTId].childId[sideId];	// branch node
+			else							return nodeTId;								// leaf node
+		}
+		return _numNodesMax;
+	}
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::searchOutLeaf(_ui nodeId, _ui axis, const type& avg, const type& sign) const
+	{
+		if (nodeId>=_numNodes) return _numNodesMax;
+		const Node& node = _pNode[nodeId];
+		const type l  = getAxis(node.elem.aabbAvg.l, axis);
+		const type h  = getAxis(node.elem.aabbAvg.h, axis);
+		const type la = (l-avg)*sign;
+		const type ha = (h-avg)*sign;
+		if (la<(const type)0 || ha<(const type)0)
+		{
+			if (node.maxLeafDistance==0) return nodeId;
+			const _ui nodeLId = searchOutLeaf(_pHot[nodeId].childId[s_childLId], axis, avg, sign);	if (nodeLId<_numNodesMax) return nodeLId;
+			const _ui nodeRId = searchOutLeaf(_pHot[nodeId].childId[s_childRId], axis, avg, sign);	if (nodeRId<_numNodesMax) return nodeRId;
+		}
+		return _numNodesMax;
+	}
+
+
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::avgIntersection(_ui nodeId, _ui childId) const
+	{
+		const _ui nodeTId = nodeId;
+		const Node& nodeT = _pNode[nodeTId];
+		if (nodeT.maxLeafDistance==0) return false;										// it's a leaf
+		const _ui nodeCId = _pHot[nodeTId].childId[childId];
+		const Node& nodeC = _pNode[nodeCId];
+		const _ui axis = axisIndex(nodeT.level);
+		const type avgT = getAxis(nodeT.elem.avg,       axis);
+		const type avgL = getAxis(nodeC.elem.aabbAvg.l, axis);
+		const type avgH = getAxis(nodeC.elem.aabbAvg.h, axis);
+		return Math::bound<type>(avgT, avgL+s_avgCoordTolerance, avgH-s_avgCoordTolerance);
+	}
+
+
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::addLeaf(const Elem& elem, _ui nodeId, _ui childId)
+	{
+		//
+		//    R           R
+		//    |           |
+		//    T    ->     P
+		//               / \
+		//              N   T
+		//
+
+		if (_numNodes+2>=_numNodesMax) return _numNodesMax;								// no additional nodes available
+		// create new structure
+		const _ui nodePId = addNodeRaw();
+		const _ui nodeNId = addNodeRaw();
+		const _ui nodeTId = nodeId;
+		const _ui childNId =  childId;
+		const _ui childTId = (childId+1) % s_numChildren;
+		Node& nodeP = _pNode[nodePId];
+		Node& nodeN = _pNode[nodeNId];
+		Node& nodeT = _pNode[nodeTId];
+		// update P
+		_pHot[nodePId].childId[childTId]	= nodeTId;
+		_pHot[nodePId].childId[childNId]	= nodeNId;
+		nodeP.parentId			= nodeT.parentId;
+		nodeP.parentChildId		= nodeT.parentChildId;
+		nodeP.level				= nodeT.level;
+		nodeP.maxLeafDistance	= 1;
+		// update N
+		setLeaf(nodeNId, elem, Vec3<type>((const type)0));
+		_pHot[nodeNId].childId[0]	= _numNodesMax;
+		_pHot[nodeNId].childId[1]	= _numNodesMax;
+		nodeN.parentId			= nodePId;
+		nodeN.parentChildId		= childNId;
+		nodeN.level				= nodeP.level+1;
+		nodeN.maxLeafDistance	= 0;
+		nodeN.numAvg			= 1;
+		// update T
+		nodeT.parentId			= nodePId;
+		nodeT.parentChildId		= childTId;
+		nodeT.level				= nodeP.level+1;
+		nodeT.maxLeafDistance	= 0;
+		// update R
+		updateParent(nodePId);
+		// update root
+		updateRoot(nodePId);
+		// recalculate branch P
+		recalculate(nodePId);
+		// restructurize branch P
+		if (_bAvgOrder) restructurize(nodePId, _rootNodeId, 0);
+		// rotate path of P
+		if (_bRotation) rotatePath(nodePId);
+		return nodeNId;
+	}
+	
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::delLeaf(_ui nodeId)
+	{
+		//
+		//      R          R
+		//      |          |
+		//      P    ->    N
+		//     / \
+		//    T   N
+		//
+
+		const _ui nodeTId = nodeId;
+		const _ui nodeNId = getNeighborNode(nodeTId);
+		Node& nodeT = _pNode[nodeTId];
+		Node& nodeN = _pNode[nodeNId];
+		const _ui nodePId = nodeT.parentId;
+		Node& nodeP = _pNode[nodePId];
+		// update N
+		nodeN.parentId		= nodeP.parentId;
+		nodeN.parentChildId	= nodeP.parentChildId;
+		nodeN.level			= nodeP.level;
+		// update R
+		updateParent(nodeNId);
+		// update N
+		updateChildren(nodeNId);
+		// update root
+		updateRoot(nodeNId);
+		// delete T and P
+		delNodeRaw(nodePId);
+		delNodeRaw(nodeTId);
+		// recalculate branch N
+		recalculate(nodeN.parentId);
+		// restructurize branch N
+		if (_bAvgOrder) restructurize(nodeN.parentId, _rootNodeId, 1);
+		// rotate path of N
+		if (_bRotation) rotatePath(nodeN.parentId);
+		return true;	
+	}
+	
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::moveLeaf(_ui nodeFromId, _ui nodeToId)
+	{
+		//
+		//      R          R               Q          Q
+		//      |          |               |          |
+		//      P    ->    X               T    ->    P
+		//     / \              ------>              / \
+		//    F   X                                 F   T
+		//
+
+		if (nodeFromId==nodeToId) return true;
+		const _ui nodeFId = nodeFromId;
+		const _ui nodeTId = nodeToId;
+		Node& nodeF = _pNode[nodeFId];
+		Node& nodeT = _pNode[nodeTId];
+		const _ui nodePId = nodeF.parentId;
+		const _ui nodeXId = getNeighborNode(nodeFId);
+		Node& nodeP = _pNode[nodePId];
+		Node& nodeX = _pNode[nodeXId];
+		// update X
+		nodeX.parentId			= nodeP.parentId;
+		nodeX.parentChildId		= nodeP.parentChildId;
+		nodeX.level				= nodeP.level;
+		// update P
+		const _ui childFId		= switchAxis(nodeF.elem.avg, nodeT.elem.avg, nodeT.level);
+		const _ui childTId		= (childFId + 1) % s_numChildren;
+		_pHot[nodePId].childId[childFId]	= nodeFId;
+		_pHot[nodePId].childId[childTId]	= nodeTId;
+		nodeP.parentId			= nodeT.parentId;
+		nodeP.parentChildId		= nodeT.parentChildId;
+		nodeP.level				= nodeT.level;
+		// update T
+		nodeT.parentId			= nodePId;
+		nodeT.parentChildId		= childTId;
+		nodeT.level				= nodeP.level+1;
+		// update F
+		nodeF.parentId			= nodePId;
+		nodeF.parentChildId		= childFId;
+		nodeF.level				= nodeP.level+1;
+		// update R
+		updateParent(nodeXId);
+		// update Q
+		updateParent(nodePId);
+		// update X
+		updateChildren(nodeXId);
+		// update root
+		updateRoot(nodeXId);
+		updateRoot(nodePId);
+		// recalculate branch X
+		recalculate(nodeX.parentId);
+		// recalculate branch P
+		recalculate(nodePId);
+		// rotate paths of X and P
+		if (_bRotation)
+		{
+			rotatePath(nodeX.parentId);
+			rotatePath(nodePId);
+		}
+		return true;
+	}
+
+
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::updateElem(_ui nodeId)
+	{
+		Node& nodeT = _pNode[nodeId];
+		Hot&  hotT  = _pHot[nodeId];
+		const _ui nodeLId = hotT.childId[s_childLId];
+		const _ui nodeRId = hotT.childId[s_childRId];
+		const Node& nodeL = _pNode[nodeLId];
+		const Node& nodeR = _pNode[nodeRId];
+		nodeT.elem.avg		= ( (nodeL.elem.avg * (const type)(nodeL.numAvg))  +  (nodeR.elem.avg * (const type)(nodeR.numAvg)) )  /  (const type)(nodeT.numAvg);
+		nodeT.elem.aabbAvg	= nodeL.elem.aabbAvg + nodeR.elem.aabbAvg;
+		hotT.aabb			= _pHot[nodeLId].aabb + _pHot[nodeRId].aabb;
+	}
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::updateNode(_ui nodeId)
+	{
+		Node& nodeT = _pNode[nodeId];
+		const _ui nodeLId = _pHot[nodeId].childId[s_childLId];
+		const _ui nodeRId = _pHot[nodeId].childId[s_childRId];
+		const Node& nodeL = _pNode[nodeLId];
+		const Node& nodeR = _pNode[nodeRId];
+		nodeT.numAvg			= nodeL.numAvg  + nodeR.numAvg;
+		nodeT.maxLeafDistance	= Math::max<_ui>(nodeL.maxLeafDistance, nodeR.maxLeafDistance)+1;
+		updateElem(nodeId);
+	}
+
+
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::updateRoot(_ui nodeId)
+	{
+		const _ui nodeTId = nodeId;
+		const Node& nodeT = _pNode[nodeTId];
+		if (nodeT.level!=0) return;
+		_rootNodeId = nodeId;
+	}
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::updateParent(_ui nodeId)
+	{
+		const _ui nodeTId = nodeId;
+		const Node& nodeT = _pNode[nodeTId];
+		const _ui nodePId = _pNode[nodeTId].parentId;
+		if (nodePId>=_numNodes) return;
+		_pHot[nodePId].childId[nodeT.parentChildId] = nodeTId;
+	}
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::updateChildren(_ui nodeId)
+	{
+		if (nodeId>=_numNodes) return;
+		const _ui nodeTId = nodeId;
+		Node& nodeT = _pNode[nodeTId];
+		const _ui nodePId = nodeT.parentId;
+		if (nodePId<_numNodes) nodeT.level = _pNode[nodePId].level+1;
+		updateChildren(_pHot[nodeTId].childId[s_childLId]);
+		updateChildren(_pHot[nodeTId].childId[s_childRId]);
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::recalculate(_ui nodeId)
+	{
+		if (nodeId>=_numNodes) return false;
+		_ui nodeTId = nodeId;
+		while (nodeTId<_numNodes)
+		{
+			Node& nodeT = _pNode[nodeTId];
+			updateNode(nodeTId);
+			nodeTId = nodeT.parentId;
+		}
+		return true;
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::restructurize(_ui nodeId, _ui rootNodeId, _ui childSwap)
+	{
+		//
+		//          P                  P
+		//         / \                / \
+		//        CF CT              RF RT
+		//       .     .            .     .
+		//      .       .   --->   .       .
+		//     PF       To        NF       PF
+		//    /  \               /  \     /  \
+		//   Fr  NF                      Fr  To
+		//      /  \
+		//
+
+		if (nodeId>=_numNodes) return false;
+		_ui nodeTId = nodeId;
+		while (nodeTId!=rootNodeId)
+		{
+			Node& nodeT = _pNode[nodeTId];
+			const _ui nodePId = nodeT.parentId;
+			const _ui childId = (nodeT.parentChildId+childSwap) % s_numChildren;
+			while (avgIntersection(nodePId, childId))
+			{
+				const Node& nodeP = _pNode[nodePId];
+				const _ui axis = axisIndex(nodeP.level);
+				const type avg = getAxis(nodeP.elem.avg, axis);
+				const type sign = childId==s_childLId ? (const type)-1 : (const type)+1;
+				const _ui childFId = childId;
+				const _ui childTId = (childId+1) % s_numChildren;
+				const _ui nodeCFId = _pHot[nodePId].childId[childFId];
+				const _ui nodeCTId = _pHot[nodePId].childId[childTId];
+				const _ui nodeFrId = searchOutLeaf(	nodeCFId, axis, avg, sign);
+				const _ui nodeToId = searchLeaf(	nodeCTId, _pNode[nodeFrId].elem);
+				const _ui nodeNFId = getNeighborNode(nodeFrId);
+				const _ui nodePFId = _pNode[nodeFrId].parentId;
+				moveLeaf(nodeFrId, nodeToId);
+				const _ui nodeRFId = _pHot[nodePId].childId[childFId];
+				const _ui nodeRTId = _pHot[nodePId].childId[childTId];
+				if (!restructurize(nodeNFId, nodeRFId, 1)) return false;
+				if (!restructurize(nodePFId, nodeRTId, 0)) return false;
+			}
+			nodeTId = nodePId;
+		}
+		return true;
+	}
+
+
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::rotatePath(_ui nodeId)
+	{
+		//
+		// one bottom-up pass: rotation keeps node on its place, so path to root stays the same,
+		// bounds of path are recalculated already, rotation changes only distance to leaves of node and its child,
+		// so node is updated from its (already visited) children before it's rotated
+		//
+
+		_ui nodeTId = nodeId;
+		while (nodeTId<_numNodes)
+		{
+			updateNode(nodeTId);
+			rotateNode(nodeTId);
+			nodeTId = _pNode[nodeTId].parentId;
+		}
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::rotateNode(_ui nodeId)
+	{
+		//
+		//       T              T              T
+		//      / \            / \            / \
+		//     L   R    ->    RL  R    or    RR  R
+		//        / \            / \            / \
+		//       RL RR          L  RR          RL  L
+		//
+		// child is swapped with grandchild of other side (and the same for R) when it reduces surface area of other child (Kensler 2008)
+		//
+
+		const Node& nodeT = _pNode[nodeId];
+		if (nodeT.maxLeafDistance<2) return false;							// no grandchildren
+		_b   bRotate = false;
+		type areaMin = (const type)0;
+		_ui  childAMin = 0;
+		_ui  childBMin = 0;
+		for (_ui childAId = 0; childAId<s_numChildren; childAId++)
+		{
+			const Hot& hotA = _pHot[_pHot[nodeId].childId[childAId]];
+			const Hot& hotC = _pHot[_pHot[nodeId].childId[(childAId+1) % s_numChildren]];
+			if (hotC.childId[s_childLId]>=_numNodes) continue;				// leaf has no children to swap
+			const type areaC = hotC.aabb.area();
+			for (_ui childBId = 0; childBId<s_numChildren; childBId++)
+			{
+				// other child C would cover A and rest grandchild
+				const Hot& hotR = _pHot[hotC.childId[(childBId+1) % s_numChildren]];
+				const type area = (hotA.aabb + hotR.aabb).area();
+				const type gain = areaC - area;
+				if (gain<=(const type)0) continue;
+				if (bRotate && gain<=areaMin) continue;
+				bRotate		= true;
+				areaMin		= gain;
+				childAMin	= childAId;
+				childBMin	= childBId;
+			}
+		}
+		if (!bRotate) return false;
+		rotateChild(nodeId, childAMin, childBMin);
+		return true;
+	}
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::rotateChild(_ui nodeId, _ui childAId, _ui childBId)
+	{
+		// swap child A of T with child B of other child C of T
+		const _ui nodeTId = nodeId;
+		const _ui childCId = (childAId+1) % s_numChildren;
+		const _ui nodeAId = _pHot[nodeTId].childId[childAId];
+		const _ui nodeCId = _pHot[nodeTId].childId[childCId];
+		Node& nodeA = _pNode[nodeAId];
+		const _ui nodeBId = _pHot[nodeCId].childId[childBId];
+		Node& nodeB = _pNode[nodeBId];
+		// update T
+		_pHot[nodeTId].childId[childAId]	= nodeBId;
+		// update C
+		_pHot[nodeCId].childId[childBId]	= nodeAId;
+		// update B
+		nodeB.parentId			= nodeTId;
+		nodeB.parentChildId		= childAId;
+		// update A
+		nodeA.parentId			= nodeCId;
+		nodeA.parentChildId		= childBId;
+		// update levels of A and B, levels inside of their branches are updated lazily
+		nodeB.level				= _pNode[nodeTId].level+1;
+		nodeA.level				= _pNode[nodeCId].level+1;
+		if (nodeA.maxLeafDistance!=0 || nodeB.maxLeafDistance!=0) _bLevelLazy = true;
+		// recalculate C and T only (T keeps its leaves, so bounds and average of its parents stay the same)
+		updateNode(nodeCId);
+		updateNode(nodeTId);
+		orderChildren(nodeCId);
+		orderChildren(nodeTId);
+		// children are not ordered by averages of parents any more
+		_bAvgOrder = false;
+	}
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::updateDistance(_ui nodeId)
 	{
-		try	{	delete[] _pNode;		}	catch(...)	{};
-		try	{	delete[] _pFreeNode;	}	catch(...)	{};
-		reset();
+		// distance to leaves of parents of rotated node, stops at first parent which keeps it
+		_ui nodeTId = nodeId;
+		while (nodeTId<_numNodes)
+		{
+			Node& nodeT = _pNode[nodeTId];
+			const _ui distance = Math::max<_ui>(_pNode[_pHot[nodeTId].childId[s_childLId]].maxLeafDistance, _pNode[_pHot[nodeTId].childId[s_childRId]].maxLeafDistance)+1;
+			if (nodeT.maxLeafDistance==distance) break;
+			nodeT.maxLeafDistance = distance;
+			nodeTId = nodeT.parentId;
+		}
 	}
 
 
 
-	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::addNodeRaw(void)
-	{
-		return _numFreeNodes ? _pFreeNode[--_numFreeNodes] : _numNodes++;
-	}
-	
-	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::delNodeRaw(_ui nodeId)
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::orderDFS(_ui nodeId, _ui* pOrder, _ui& numOrder) const
 	{
-		if (nodeId<_numNodes-1)	_pFreeNode[_numFreeNodes++] = nodeId;
-		else					_numNodes--;
+		pOrder[numOrder++] = nodeId;
+		const Hot& hot = _pHot[nodeId];
+		if (hot.childId[s_childLId]>=_numNodes) return;						// leaf node
+		orderDFS(hot.childId[s_childLId], pOrder, numOrder);
+		orderDFS(hot.childId[s_childRId], pOrder, numOrder);
 	}
 
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::orderVEB(_ui nodeId, _ui numLevels, _ui* pOrder, _ui& numOrder) const
+	{
+		//
+		//          T           numLevels/2 top levels of subtree are ordered first,
+		//         / \          then every bottom subtree under them one by one,
+		//        .   .         both halves are ordered the same way
+		//       / \ / \
+		//      B  B B  B
+		//
 
+		if (numLevels<=1)
+		{
+			pOrder[numOrder++] = nodeId;
+			return;
+		}
+		const _ui numLevelsTop = numLevels/2;
+		orderVEB(nodeId, numLevelsTop, pOrder, numOrder);
+		orderVEBBottom(nodeId, numLevelsTop, numLevels-numLevelsTop, pOrder, numOrder);
+	}
 
-	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::getNeighborNode(_ui nodeId) const
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::orderVEBBottom(_ui nodeId, _ui depth, _ui numLevels, _ui* pOrder, _ui& numOrder) const
 	{
-		const _ui nodePId = _pNode[nodeId].parentId;
-		const _ui parentNeighborChildId = (_pNode[nodeId].parentChildId + 1) % s_numChildren;
-		return _pNode[nodePId].childId[parentNeighborChildId];
+		// roots of bottom subtrees are depth levels below node, leaves above them are ordered with top already
+		if (!depth)
+		{
+			orderVEB(nodeId, numLevels, pOrder, numOrder);
+			return;
+		}
+		const Hot& hot = _pHot[nodeId];
+		if (hot.childId[s_childLId]>=_numNodes) return;						// leaf node
+		orderVEBBottom(hot.childId[s_childLId], depth-1, numLevels, pOrder, numOrder);
+		orderVEBBottom(hot.childId[s_childRId], depth-1, numLevels, pOrder, numOrder);
 	}
 
-	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::getDownNode(_ui nodeId, _ui path, _ui depth) const
+
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::select(Key* pKey, _ui iLo, _ui iHi, _ui iNth, _ui axis)
 	{
-		_ui nodeTId = nodeId;
-		for (_ui d = 0; d<depth, nodeTId<_numNodes; d++)
+		// partial quick sort, key at iNth is on its sorted place, lower keys before, higher keys after
+		_i lo = (_i)iLo;
+		_i hi = (_i)iHi;
+		const _i nth = (_i)iNth;
+		while (lo<hi)
 		{
-			const _ui childId = (path & (1<<d));
-			nodeTId = _pNode[nodeTId].childId[childId];
+			// median of three is pivot and bounds of partition
+			const _i mid = (lo + hi)>>1;
+			if (getAxis(pKey[mid].avg, axis)<getAxis(pKey[lo].avg,  axis)) __swap<Key>(pKey[mid], pKey[lo]);
+			if (getAxis(pKey[hi].avg,  axis)<getAxis(pKey[lo].avg,  axis)) __swap<Key>(pKey[hi],  pKey[lo]);
+			if (getAxis(pKey[hi].avg,  axis)<getAxis(pKey[mid].avg, axis)) __swap<Key>(pKey[hi],  pKey[mid]);
+			const type val = getAxis(pKey[mid].avg, axis);
+			_i i = lo;
+			_i j = hi;
+			while (i<=j)
+			{
+				while (getAxis(pKey[i].avg, axis)<val) i++;
+				while (getAxis(pKey[j].avg, axis)>val) j--;
+				if (i<=j) __swap<Key>(pKey[i++], pKey[j--]);
+			}
+			if		(nth<=j)	hi = j;
+			else if	(nth>=i)	lo = i;
+			else				return;
 		}
-		return nodeTId;
 	}
 
 
 
-	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::axisIndex(_ui level) const
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::sort(Key* pKey, _ui iLo, _ui iHi, _ui level, _ui numThreads)
 	{
-		return (level % 3);
+		if (iLo==iHi)
+		{
+			_pNode[pKey[iLo].nodeId].level = level;
+			return pKey[iLo].nodeId;
+		}
+		const _ui iMid = (iLo + iHi)>>1;
+		select(pKey, iLo, iHi, iMid, axisIndex(level));
+		// left branch on new thread, right branch on this thread
+		std::thread task;
+		_b bTask = false;
+		if (numThreads>1 && iHi-iLo+1>=s_numTaskLeaves)
+		{
+			try
+			{
+				task = std::thread(&BVH3::sortTask, this, pKey, iLo, iMid, level+1, numThreads>>1);
+				bTask = true;
+			}
+			catch(...)	{};
+		}
+		if (!bTask) sort(pKey, iLo, iMid, level+1, numThreads);
+		sort(pKey, iMid+1, iHi, level+1, bTask ? numThreads-(numThreads>>1) : numThreads);
+		if (bTask) task.join();
+		const _ui nodeTId = branchId(pKey, iLo, iHi);
+		linkNode(nodeTId, branchId(pKey, iLo, iMid), branchId(pKey, iMid+1, iHi), level);
+		updateNode(nodeTId);
+		return nodeTId;
 	}
 
-	template <class callBack, typename type, typename data> type __fastcall BVH3<callBack, type, data>::getAxis(const Vec3<type>& vec, _ui axisId) const
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::sortTask(Key* pKey, _ui iLo, _ui iHi, _ui level, _ui numThreads)
 	{
-		const type v[3] = { vec.x, vec.y, vec.z };
-		return v[axisId];
+		sort(pKey, iLo, iHi, level, numThreads);
 	}
 
-	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::switchAxis(const Vec3<type>& avgLeaf, const Vec3<type>& avgBranch, _ui level) const
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::branchId(const Key* pKey, _ui iLo, _ui iHi) const
 	{
-		const _ui axis = axisIndex(level);
-		const type avgL = getAxis(avgLeaf, axis);
-		const type avgB = getAxis(avgBranch, axis);
-		return avgL <= avgB ? 0 : 1;
+		// branch of sorted leaves [iLo..iHi] is a node after leaves by index of its split
+		return iLo==iHi ? pKey[iLo].nodeId : _numNodes + ((iLo + iHi)>>1);
 	}
 
 
 
-	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::searchLeaf(_ui nodeId, const Elem& elem) const
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::linkNode(_ui nodeId, _ui nodeLId, _ui nodeRId, _ui level)
 	{
-		_ui nodeTId = nodeId;
-		for (_ui i = 0; i<_numNodes; i++)												// inf limited cycle
-		{
-			Node& nodeT = _pNode[nodeTId];
-			const _ui sideId = switchAxis(elem.avg, nodeT.elem.avg, nodeT.level);		// get child index side of node by average point of this node
-			if (nodeT.maxLeafDistance!=0)	nodeTId = nodeT.childId[sideId];			// branch node
-			else							return nodeTId;								// leaf node
-		}
-		return _numNodesMax;
+		Node& nodeT = _pNode[nodeId];
+		Node& nodeL = _pNode[nodeLId];
+		Node& nodeR = _pNode[nodeRId];
+		_pHot[nodeId].childId[s_childLId]	= nodeLId;
+		_pHot[nodeId].childId[s_childRId]	= nodeRId;
+		nodeT.level					= level;
+		nodeT.uid					= _numNodesMax;
+		nodeL.parentId				= nodeId;
+		nodeL.parentChildId			= s_childLId;
+		nodeR.parentId				= nodeId;
+		nodeR.parentChildId			= s_childRId;
 	}
 
-	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::searchOutLeaf(_ui nodeId, _ui axis, const type& avg, const type& sign) const
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::splitSAH(SAH& sah, _ui iLo, _ui iHi) const
 	{
-		if (nodeId>=_numNodes) return _numNodesMax;
-		const Node& node = _pNode[nodeId];
-		const type l  = getAxis(node.elem.aabbAvg.l, axis);
-		const type h  = getAxis(node.elem.aabbAvg.h, axis);
-		const type la = (l-avg)*sign;
-		const type ha = (h-avg)*sign;
-		if (la<(const type)0 || ha<(const type)0)
+		// AABB of leaves averages of range
+		AABB3<type> aabbAvg(_pNode[sah.pIndex[iLo]].elem.avg);
+		for (_ui i = iLo+1; i<=iHi; i++)
+			aabbAvg.expand(_pNode[sah.pIndex[i]].elem.avg);
+		// search the cheapest split plane between bins on all axes
+		const _ui numLeaves = iHi-iLo+1;
+		const _ui numBins = sah.numBins;
+		_b   bSplit = false;
+		type costMin = (const type)0;
+		type loMin = (const type)0;
+		type scaleMin = (const type)0;
+		_ui  axisMin = 0;
+		_ui  binMin = 0;
+		for (_ui axis = 0; axis<3; axis++)
 		{
-			if (node.maxLeafDistance==0) return nodeId;
-			const _ui nodeLId = searchOutLeaf(node.childId[s_childLId], axis, avg, sign);	if (nodeLId<_numNodesMax) return nodeLId;
-			const _ui nodeRId = searchOutLeaf(node.childId[s_childRId], axis, avg, sign);	if (nodeRId<_numNodesMax) return nodeRId;
+			const type lo = getAxis(aabbAvg.l, axis);
+			const type hi = getAxis(aabbAvg.h, axis);
+			if (hi<=lo) continue;													// all averages are on one plane
+			const type scale = (const type)numBins / (hi-lo);
+			for (_ui b = 0; b<numBins; b++)
+				sah.pBin[b].num = 0;
+			for (_ui i = iLo; i<=iHi; i++)
+			{
+				const Elem& elem = _pNode[sah.pIndex[i]].elem;
+				Bin& bin = sah.pBin[binSAH(sah, getAxis(elem.avg, axis), lo, scale)];
+				if (bin.num)	bin.aabb.expand(elem.aabb);
+				else			bin.aabb = elem.aabb;
+				bin.num++;
+			}
+			// costs of right sides
+			AABB3<type> aabbR(aabbAvg);										// replaced by first not empty bin
+			_ui numR = 0;
+			for (_ui b = numBins-1; b>0; b--)
+			{
+				const Bin& bin = sah.pBin[b];
+				if (bin.num)
+				{
+					if (numR)	aabbR.expand(bin.aabb);
+					else		aabbR = bin.aabb;
+					numR += bin.num;
+				}
+				sah.pArea[b] = numR ? aabbR.area() * (const type)numR : (const type)0;
+			}
+			// costs of left sides
+			AABB3<type> aabbL(aabbAvg);										// replaced by first not empty bin
+			_ui numL = 0;
+			for (_ui b = 0; b<numBins-1; b++)
+			{
+				const Bin& bin = sah.pBin[b];
+				if (bin.num)
+				{
+					if (numL)	aabbL.expand(bin.aabb);
+					else		aabbL = bin.aabb;
+					numL += bin.num;
+				}
+				if (!numL || numL==numLeaves) continue;
+				const type cost = aabbL.area() * (const type)numL + sah.pArea[b+1];
+				if (bSplit && cost>=costMin) continue;
+				bSplit		= true;
+				costMin		= cost;
+				loMin		= lo;
+				scaleMin	= scale;
+				axisMin		= axis;
+				binMin		= b;
+			}
 		}
-		return _numNodesMax;
+		// all averages are equal, split by half
+		if (!bSplit) return (iLo + iHi)>>1;
+		// partition leaves by split plane
+		_ui lo = iLo;
+		_ui hi = iHi+1;
+		while (lo<hi)
+		{
+			const Elem& elem = _pNode[sah.pIndex[lo]].elem;
+			if (binSAH(sah, getAxis(elem.avg, axisMin), loMin, scaleMin)<=binMin)
+			{
+				lo++;
+				continue;
+			}
+			hi--;
+			__swap<_ui>(sah.pIndex[lo], sah.pIndex[hi]);
+		}
+		return lo-1;
 	}
 
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::binSAH(const SAH& sah, const type& avg, const type& lo, const type& scale) const
+	{
+		const _ui binId = (_ui)((avg-lo)*scale);
+		return binId<sah.numBins ? binId : sah.numBins-1;
+	}
 
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::sortSAH(SAH& sah, _ui iLo, _ui iHi, _ui level)
+	{
+		if (iLo==iHi)
+		{
+			const _ui nodeId = sah.pIndex[iLo];
+			_pNode[nodeId].level = level;
+			return nodeId;
+		}
+		const _ui iMid = splitSAH(sah, iLo, iHi);
+		const _ui nodeLId = sortSAH(sah, iLo,    iMid, level+1);
+		const _ui nodeRId = sortSAH(sah, iMid+1, iHi,  level+1);
+		const _ui nodeTId = _numNodes++;
+		linkNode(nodeTId, nodeLId, nodeRId, level);
+		updateNode(nodeTId);
+		orderChildren(nodeTId);
+		return nodeTId;
+	}
 
-	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::avgIntersection(_ui nodeId, _ui childId) const
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::orderChildren(_ui nodeId)
 	{
-		const _ui nodeTId = nodeId;
-		const Node& nodeT = _pNode[nodeTId];
-		if (nodeT.maxLeafDistance==0) return false;										// it's a leaf
-		const _ui nodeCId = nodeT.childId[childId];
-		const Node& nodeC = _pNode[nodeCId];
-		const _ui axis = axisIndex(nodeT.level);
-		const type avgT = getAxis(nodeT.elem.avg,       axis);
-		const type avgL = getAxis(nodeC.elem.aabbAvg.l, axis);
-		const type avgH = getAxis(nodeC.elem.aabbAvg.h, axis);
-		return Math::bound<type>(avgT, avgL+s_avgCoordTolerance, avgH-s_avgCoordTolerance);
+		// keep children ordered by averages on axis of level for dynamic updates
+		Hot& hotT = _pHot[nodeId];
+		const _ui nodeLId = hotT.childId[s_childLId];
+		const _ui nodeRId = hotT.childId[s_childRId];
+		const _ui axis = axisIndex(_pNode[nodeId].level);
+		if (getAxis(_pNode[nodeLId].elem.avg, axis)<=getAxis(_pNode[nodeRId].elem.avg, axis)) return;
+		hotT.childId[s_childLId]		= nodeRId;
+		hotT.childId[s_childRId]		= nodeLId;
+		_pNode[nodeRId].parentChildId	= s_childLId;
+		_pNode[nodeLId].parentChildId	= s_childRId;
 	}
 
 
 
-	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::addLeaf(const Elem& elem, _ui nodeId, _ui childId)
+	template <class callBack, typename type, typename data> typename BVH3<callBack, type, data>::MortonCode __fastcall BVH3<callBack, type, data>::mortonCode(const Vec3<type>& avg, const LBVH& lbvh) const
 	{
-		//
-		//    R           R
-		//    |           |
-		//    T    ->     P
-		//               / \
-		//              N   T
-		//
+		const type n = (const type)((1<<lbvh.numBits)-1);
+		MortonCode c[3];
+		for (_ui axis = 0; axis<3; axis++)
+		{
+			const type lo = getAxis(lbvh.aabbAvg.l, axis);
+			const type hi = getAxis(lbvh.aabbAvg.h, axis);
+			const type v  = hi>lo ? (getAxis(avg, axis)-lo) * n / (hi-lo) : (const type)0;
+			c[axis] = mortonSplit((MortonCode)Math::min<type>(Math::max<type>(v, (const type)0), n));
+		}
+		return (c[0]<<2) | (c[1]<<1) | c[2];
+	}
 
-		if (_numNodes+2>=_numNodesMax) return _numNodesMax;								// no additional nodes available
-		// create new structure
-		const _ui nodePId = addNodeRaw();
-		const _ui nodeNId = addNodeRaw();
-		const _ui nodeTId = nodeId;
-		const _ui childNId =  childId;
-		const _ui childTId = (childId+1) % s_numChildren;
-		Node& nodeP = _pNode[nodePId];
-		Node& nodeN = _pNode[nodeNId];
-		Node& nodeT = _pNode[nodeTId];
-		// update P
-		nodeP.childId[childTId]	= nodeTId;
-		nodeP.childId[childNId]	= nodeNId;
-		nodeP.parentId			= nodeT.parentId;
-		nodeP.parentChildId		= nodeT.parentChildId;
-		nodeP.level				= nodeT.level;
-		nodeP.maxLeafDistance	= 1;
-		// update N
-		nodeN.elem				= elem;
-		nodeN.elem.aabbAvg		= elem.avg;
-		nodeN.childId[0]		= _numNodesMax;
-		nodeN.childId[1]		= _numNodesMax;
-		nodeN.parentId			= nodePId;
-		nodeN.parentChildId		= childNId;
-		nodeN.level				= nodeP.level+1;
-		nodeN.maxLeafDistance	= 0;
-		nodeN.numAvg			= 1;
-		// update T
-		nodeT.parentId			= nodePId;
-		nodeT.parentChildId		= childTId;
-		nodeT.level				= nodeP.level+1;
-		nodeT.maxLeafDistance	= 0;
-		// update R
-		updateParent(nodePId);
-		// update root
-		updateRoot(nodePId);
-		// recalculate branch P
-		recalculate(nodePId);
-		// restructurize branch P
-		restructurize(nodePId, _rootNodeId, 0);
-		return nodeNId;
+	template <class callBack, typename type, typename data> typename BVH3<callBack, type, data>::MortonCode __fastcall BVH3<callBack, type, data>::mortonSplit(MortonCode v) const
+	{
+		// spread 21 low bits to every third bit
+		v &= 0x1fffffull;
+		v = (v | v<<32) & 0x1f00000000ffffull;
+		v = (v | v<<16) & 0x1f0000ff0000ffull;
+		v = (v | v<<8)  & 0x100f00f00f00f00full;
+		v = (v | v<<4)  & 0x10c30c30c30c30c3ull;
+		v = (v | v<<2)  & 0x1249249249249249ull;
+		return v;
 	}
-	
-	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::delLeaf(_ui nodeId)
+
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::leadingZeros(MortonCode v) const
 	{
-		//
-		//      R          R
-		//      |          |
-		//      P    ->    N
-		//     / \
-		//    T   N
-		//
+		if (!v) return 64;
+		_ui n = 0;
+		if (!(v & 0xffffffff00000000ull))	{ n += 32; v <<= 32; }
+		if (!(v & 0xffff000000000000ull))	{ n += 16; v <<= 16; }
+		if (!(v & 0xff00000000000000ull))	{ n += 8;  v <<= 8;  }
+		if (!(v & 0xf000000000000000ull))	{ n += 4;  v <<= 4;  }
+		if (!(v & 0xc000000000000000ull))	{ n += 2;  v <<= 2;  }
+		if (!(v & 0x8000000000000000ull))	{ n += 1;  }
+		return n;
+	}
 
-		const _ui nodeTId = nodeId;
-		const _ui nodeNId = getNeighborNode(nodeTId);
-		Node& nodeT = _pNode[nodeTId];
-		Node& nodeN = _pNode[nodeNId];
-		const _ui nodePId = nodeT.parentId;
-		Node& nodeP = _pNode[nodePId];
-		// update N
-		nodeN.parentId		= nodeP.parentId;
-		nodeN.parentChildId	= nodeP.parentChildId;
-		nodeN.level			= nodeP.level;
-		// update R
-		updateParent(nodeNId);
-		// update N
-		updateChildren(nodeNId);
-		// update root
-		updateRoot(nodeNId);
-		// delete T and P
-		delNodeRaw(nodePId);
-		delNodeRaw(nodeTId);
-		// recalculate branch N
-		recalculate(nodeN.parentId);
-		// restructurize branch N
-		restructurize(nodeN.parentId, _rootNodeId, 1);
-		return true;	
+	template <class callBack, typename type, typename data> _i __fastcall BVH3<callBack, type, data>::mortonDelta(const LBVH& lbvh, _i i, _i j) const
+	{
+		// length of common prefix of codes, equal codes are distinguished by positions
+		if (j<0 || j>=(_i)lbvh.numLeaves) return -1;
+		const MortonCode ci = lbvh.pCode[i];
+		const MortonCode cj = lbvh.pCode[j];
+		if (ci!=cj) return (_i)leadingZeros(ci^cj);
+		return (_i)(64 + leadingZeros((MortonCode)(i^j)));
 	}
-	
-	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::moveLeaf(_ui nodeFromId, _ui nodeToId)
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::mortonRange(LBVH& lbvh, _ui iLo, _ui iHi)
 	{
-		//
-		//      R          R               Q          Q
-		//      |          |               |          |
-		//      P    ->    X               T    ->    P
-		//     / \              ------>              / \
-		//    F   X                                 F   T
-		//
+		for (_ui i = iLo; i<iHi; i++)
+		{
+			lbvh.pIndex[i] = i;
+			lbvh.pCode[i] = mortonCode(_pNode[i].elem.avg, lbvh);
+		}
+	}
 
-		if (nodeFromId==nodeToId) return true;
-		const _ui nodeFId = nodeFromId;
-		const _ui nodeTId = nodeToId;
-		Node& nodeF = _pNode[nodeFId];
-		Node& nodeT = _pNode[nodeTId];
-		const _ui nodePId = nodeF.parentId;
-		const _ui nodeXId = getNeighborNode(nodeFId);
-		Node& nodeP = _pNode[nodePId];
-		Node& nodeX = _pNode[nodeXId];
-		// update X
-		nodeX.parentId			= nodeP.parentId;
-		nodeX.parentChildId		= nodeP.parentChildId;
-		nodeX.level				= nodeP.level;
-		// update P
-		const _ui childFId		= switchAxis(nodeF.elem.avg, nodeT.elem.avg, nodeT.level);
-		const _ui childTId		= (childFId + 1) % s_numChildren;
-		nodeP.childId[childFId] = nodeFId;
-		nodeP.childId[childTId]	= nodeTId;
-		nodeP.parentId			= nodeT.parentId;
-		nodeP.parentChildId		= nodeT.parentChildId;
-		nodeP.level				= nodeT.level;
-		// update T
-		nodeT.parentId			= nodePId;
-		nodeT.parentChildId		= childTId;
-		nodeT.level				= nodeP.level+1;
-		// update F
-		nodeF.parentId			= nodePId;
-		nodeF.parentChildId		= childFId;
-		nodeF.level				= nodeP.level+1;
-		// update R
-		updateParent(nodeXId);
-		// update Q
-		updateParent(nodePId);
-		// update X
-		updateChildren(nodeXId);
-		// update root
-		updateRoot(nodeXId);
-		updateRoot(nodePId);
-		// recalculate branch X
-		recalculate(nodeX.parentId);
-		// recalculate branch P
-		recalculate(nodePId);
-		return true;
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::radixSort(LBVH& lbvh) const
+	{
+		const _ui numBuckets = 1<<s_numRadixBits;
+		const _ui numPasses = (lbvh.numBits*3 + s_numRadixBits-1) / s_numRadixBits;
+		_ui count[numBuckets];
+		for (_ui pass = 0; pass<numPasses; pass++)
+		{
+			const _ui shift = pass*s_numRadixBits;
+			for (_ui b = 0; b<numBuckets; b++)
+				count[b] = 0;
+			for (_ui i = 0; i<lbvh.numLeaves; i++)
+				count[(lbvh.pCode[i]>>shift) & (numBuckets-1)]++;
+			_ui sum = 0;
+			for (_ui b = 0; b<numBuckets; b++)
+			{
+				const _ui num = count[b];
+				count[b] = sum;
+				sum += num;
+			}
+			for (_ui i = 0; i<lbvh.numLeaves; i++)
+			{
+				const _ui b = (_ui)((lbvh.pCode[i]>>shift) & (numBuckets-1));
+				const _ui j = count[b]++;
+				lbvh.pCodeTmp[j]  = lbvh.pCode[i];
+				lbvh.pIndexTmp[j] = lbvh.pIndex[i];
+			}
+			__swap<MortonCode*>(lbvh.pCode, lbvh.pCodeTmp);
+			__swap<_ui*>(lbvh.pIndex, lbvh.pIndexTmp);
+		}
 	}
 
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::linkRange(LBVH& lbvh, _ui iLo, _ui iHi)
+	{
+		//
+		// branch node i covers sorted leaves [i..j] or [j..i], it's split at
+		// the highest bit differing inside of range (Karras 2012)
+		//
 
+		const _ui nodeBaseId = lbvh.numLeaves;
+		for (_ui n = iLo; n<iHi; n++)
+		{
+			const _i i = (_i)n;
+			// direction of range
+			const _i d = mortonDelta(lbvh, i, i+1)>mortonDelta(lbvh, i, i-1) ? 1 : -1;
+			// length of range
+			const _i deltaMin = mortonDelta(lbvh, i, i-d);
+			_i lMax = 2;
+			while (mortonDelta(lbvh, i, i+lMax*d)>deltaMin) lMax <<= 1;
+			_i l = 0;
+			for (_i t = lMax>>1; t>0; t >>= 1)
+				if (mortonDelta(lbvh, i, i+(l+t)*d)>deltaMin) l += t;
+			const _i j = i + l*d;
+			// split position
+			const _i deltaNode = mortonDelta(lbvh, i, j);
+			_i s = 0;
+			for (_i t = (l+1)>>1; ; t = (t+1)>>1)
+			{
+				if (mortonDelta(lbvh, i, i+(s+t)*d)>deltaNode) s += t;
+				if (t<=1) break;
+			}
+			const _i split = i + s*d + Math::min<_i>(d, 0);
+			// link children
+			const _ui nodeLId = Math::min<_i>(i, j)==split   ? lbvh.pIndex[split]   : nodeBaseId+split;
+			const _ui nodeRId = Math::max<_i>(i, j)==split+1 ? lbvh.pIndex[split+1] : nodeBaseId+split+1;
+			linkNode(nodeBaseId+n, nodeLId, nodeRId, 0);
+		}
+	}
 
-	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::updateElem(_ui nodeId)
+	template <class callBack, typename type, typename data> template <class task> void __fastcall BVH3<callBack, type, data>::parallel(task& t, _ui num, _ui numThreads, void (BVH3::*func)(task& t, _ui iLo, _ui iHi))
 	{
-		Node& nodeT = _pNode[nodeId];
-		const _ui nodeLId = nodeT.childId[s_childLId];
-		const _ui nodeRId = nodeT.childId[s_childRId];
-		const Node& nodeL = _pNode[nodeLId];
-		const Node& nodeR = _pNode[nodeRId];
-		nodeT.elem.avg		= ( (nodeL.elem.avg * (const type)(nodeL.numAvg))  +  (nodeR.elem.avg * (const type)(nodeR.numAvg)) )  /  (const type)(nodeT.numAvg);
-		nodeT.elem.aabb		= nodeL.elem.aabb + nodeR.elem.aabb;
-		nodeT.elem.aabbAvg	= nodeL.elem.aabbAvg + nodeR.elem.aabbAvg;
+		const _ui numTasks = Math::max<_ui>(Math::min<_ui>(numThreads, num), 1);
+		std::thread* pThread = NULL;
+		_ui numStarted = 0;
+		if (numTasks>1)
+		{
+			try
+			{
+				pThread = new std::thread[numTasks-1];
+				for (; numStarted<numTasks-1; numStarted++)
+				{
+					const _ui iLo = (_ui)((_d)num * numStarted / numTasks);
+					const _ui iHi = (_ui)((_d)num * (numStarted+1) / numTasks);
+					pThread[numStarted] = std::thread(func, this, std::ref(t), iLo, iHi);
+				}
+			}
+			catch(...)	{};
+		}
+		// rest of ranges on this thread
+		(this->*func)(t, (_ui)((_d)num * numStarted / numTasks), num);
+		for (_ui t = 0; t<numStarted; t++)
+			pThread[t].join();
+		try	{	delete[] pThread;	}	catch(...)	{};
 	}
 
-	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::updateNode(_ui nodeId)
+	template <class callBack, typename type, typename data> template <class task> void __fastcall BVH3<callBack, type, data>::parallel(task& t, _ui num, _ui numThreads, void (BVH3::*func)(task& t, _ui iLo, _ui iHi) const) const
 	{
-		Node& nodeT = _pNode[nodeId];
-		const _ui nodeLId = nodeT.childId[s_childLId];
-		const _ui nodeRId = nodeT.childId[s_childRId];
-		const Node& nodeL = _pNode[nodeLId];
-		const Node& nodeR = _pNode[nodeRId];
-		nodeT.numAvg			= nodeL.numAvg  + nodeR.numAvg;
-		nodeT.maxLeafDistance	= Math::max<_ui>(nodeL.maxLeafDistance, nodeR.maxLeafDistance)+1;
-		updateElem(nodeId);
+		const _ui numTasks = Math::max<_ui>(Math::min<_ui>(numThreads, num), 1);
+		std::thread* pThread = NULL;
+		_ui numStarted = 0;
+		if (numTasks>1)
+		{
+			try
+			{
+				pThread = new std::thread[numTasks-1];
+				for (; numStarted<numTasks-1; numStarted++)
+				{
+					const _ui iLo = (_ui)((_d)num * numStarted / numTasks);
+					const _ui iHi = (_ui)((_d)num * (numStarted+1) / numTasks);
+					pThread[numStarted] = std::thread(func, this, std::ref(t), iLo, iHi);
+				}
+			}
+			catch(...)	{};
+		}
+		// rest of ranges on this thread
+		(this->*func)(t, (_ui)((_d)num * numStarted / numTasks), num);
+		for (_ui t = 0; t<numStarted; t++)
+			pThread[t].join();
+		try	{	delete[] pThread;	}	catch(...)	{};
 	}
 
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::updateTree(_ui nodeId)
+	{
+		const Hot& hotT = _pHot[nodeId];
+		if (hotT.childId[s_childLId]>=_numNodes) return;		// leaf node
+		updateTree(hotT.childId[s_childLId]);
+		updateTree(hotT.childId[s_childRId]);
+		updateNode(nodeId);
+		orderChildren(nodeId);
+	}
+	
+	
+	
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::update(_ui nodeId)
+	{
+		const Hot& hotT = _pHot[nodeId];
+		if (hotT.childId[s_childLId]<_numNodes)		// branch node
+		{
+			const _ui nodeLId = hotT.childId[s_childLId];
+			const _ui nodeRId = hotT.childId[s_childRId];
+			update(nodeLId);
+			update(nodeRId);
+			updateElem(nodeId);
+		}
+	}
 
+	
+	
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::intersection(const Elem& elem, _ui nodeId, _b bSubAvg) const
+	{
+		if (nodeId>=_numNodes) return false;
+		const Hot& hot = _pHot[nodeId];
+		if (bSubAvg && elem.aabbAvg.cover(hot.aabb)) return false;
+		if (!elem.aabb.intersect(hot.aabb)) return false;
+		if (hot.childId[s_childLId]<_numNodes) return true;					// branch node
+		return !_bFat || elem.aabb.intersect(_pNode[nodeId].aabbTight);	// leaf node
+	}
 
-	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::updateRoot(_ui nodeId)
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::intersectionRay(const Vec3<type>& origin, const Vec3<type>& invDir, const type& t, _ui nodeId, type& tNear) const
 	{
-		const _ui nodeTId = nodeId;
-		const Node& nodeT = _pNode[nodeTId];
-		if (nodeT.level!=0) return;
-		_rootNodeId = nodeId;
+		if (nodeId>=_numNodes) return false;
+		const Hot& hot = _pHot[nodeId];
+		if (!hot.aabb.intersectRay(origin, invDir, t, tNear)) return false;
+		if (hot.childId[s_childLId]<_numNodes || !_bFat) return true;
+		return _pNode[nodeId].aabbTight.intersectRay(origin, invDir, t, tNear);	// leaf node in fat mode
 	}
 
-	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::updateParent(_ui nodeId)
+	template <class callBack, typename type, typename data> type __fastcall BVH3<callBack, type, data>::distance2(const Vec3<type>& dot, _ui nodeId, callBack& callBackClass, callBackDistanceFunc distanceFunc) const
 	{
-		const _ui nodeTId = nodeId;
-		const Node& nodeT = _pNode[nodeTId];
-		const _ui nodePId = _pNode[nodeTId].parentId;
-		if (nodePId>=_numNodes) return;
-		Node& nodeP = _pNode[nodePId];
-		nodeP.childId[nodeT.parentChildId] = nodeTId;
+		const Hot& hot = _pHot[nodeId];
+		if (hot.childId[s_childLId]<_numNodes) return hot.aabb.distance2(dot);	// branch node
+		const Node& node = _pNode[nodeId];
+		const type dist2 = node.aabbTight.distance2(dot);					// leaf node
+		if (!distanceFunc) return dist2;
+		return Math::max<type>((callBackClass.*distanceFunc)(dot, node.elem), dist2);
 	}
 
-	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::updateChildren(_ui nodeId)
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::intersectionSweep(const AABB3<type>& aabbSwept, const AABB3<type>& aabb, const Vec3<type>& invVec, _ui nodeId, Sweep& sweep) const
 	{
-		if (nodeId>=_numNodes) return;
-		const _ui nodeTId = nodeId;
-		Node& nodeT = _pNode[nodeTId];
-		const _ui nodePId = nodeT.parentId;
-		if (nodePId<_numNodes) nodeT.level = _pNode[nodePId].level+1;
-		updateChildren(nodeT.childId[s_childLId]);
-		updateChildren(nodeT.childId[s_childRId]);
+		const Hot& hot = _pHot[nodeId];
+		const AABB3<type>& aabbNode = hot.childId[s_childLId]<_numNodes ? hot.aabb : _pNode[nodeId].aabbTight;
+		if (!aabbSwept.intersect(aabbNode)) return false;
+		sweep.nodeId = nodeId;
+		return aabbNode.intersectMove(aabb, invVec, sweep.tEnter, sweep.tExit);
 	}
 
-	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::recalculate(_ui nodeId)
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::sweepDown(Sweep* pSweep, _ui numSweeps, _ui i) const
 	{
-		if (nodeId>=_numNodes) return false;
-		_ui nodeTId = nodeId;
-		while (nodeTId<_numNodes)
+		// sift down of heap by latest entry
+		const Sweep sweepT = pSweep[i];
+		for (;;)
 		{
-			Node& nodeT = _pNode[nodeTId];
-			updateNode(nodeTId);
-			nodeTId = nodeT.parentId;
+			_ui c = i*2+1;
+			if (c>=numSweeps) break;
+			if (c+1<numSweeps && pSweep[c+1].tEnter>pSweep[c].tEnter) c++;
+			if (sweepT.tEnter>=pSweep[c].tEnter) break;
+			pSweep[i] = pSweep[c];
+			i = c;
 		}
-		return true;
+		pSweep[i] = sweepT;
 	}
 
-	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::restructurize(_ui nodeId, _ui rootNodeId, _ui childSwap)
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::cull(const Volume& volume, _ui mask, _ui* pNodeId, _ui numNodeIdsMax) const
 	{
 		//
-		//          P                  P
-		//         / \                / \
-		//        CF CT              RF RT
-		//       .     .            .     .
-		//      .       .   --->   .       .
-		//     PF       To        NF       PF
-		//    /  \               /  \     /  \
-		//   Fr  NF                      Fr  To
-		//      /  \
+		// every node keeps mask of planes its parent is not completely inside of,
+		// subtree of node completely inside of volume is taken without any checks
 		//
 
-		if (nodeId>=_numNodes) return false;
-		_ui nodeTId = nodeId;
-		while (nodeTId!=rootNodeId)
+		if (!_numNodes) return 0;
+		Cull  stack[s_numStackNodes];
+		Cull* pStack = stack;
+		const _ui numStackNodesMax = _pNode[_rootNodeId].maxLeafDistance+1;
+		if (numStackNodesMax>s_numStackNodes)
 		{
-			Node& nodeT = _pNode[nodeTId];
-			const _ui nodePId = nodeT.parentId;
-			const _ui childId = (nodeT.parentChildId+childSwap) % s_numChildren;
-			while (avgIntersection(nodePId, childId))
+			try
 			{
-				const Node& nodeP = _pNode[nodePId];
-				const _ui axis = axisIndex(nodeP.level);
-				const type avg = getAxis(nodeP.elem.avg, axis);
-				const type sign = childId==s_childLId ? (const type)-1 : (const type)+1;
-				const _ui childFId = childId;
-				const _ui childTId = (childId+1) % s_numChildren;
-				const _ui nodeCFId = nodeP.childId[childFId];
-				const _ui nodeCTId = nodeP.childId[childTId];
-				const _ui nodeFrId = searchOutLeaf(	nodeCFId, axis, avg, sign);
-				const _ui nodeToId = searchLeaf(	nodeCTId, _pNode[nodeFrId].elem);
-				const _ui nodeNFId = getNeighborNode(nodeFrId);
-				const _ui nodePFId = _pNode[nodeFrId].parentId;
-				moveLeaf(nodeFrId, nodeToId);
-				const _ui nodeRFId = nodeP.childId[childFId];
-				const _ui nodeRTId = nodeP.childId[childTId];
-				if (!restructurize(nodeNFId, nodeRFId, 1)) return false;
-				if (!restructurize(nodePFId, nodeRTId, 0)) return false;
+				pStack = new Cull[numStackNodesMax];
+			}
+			catch(...)
+			{
+				return 0;
 			}
-			nodeTId = nodePId;
 		}
-		return true;
+		_ui numNodeIds = 0;
+		_ui numStackNodes = 0;
+		pStack[numStackNodes].nodeId	= _rootNodeId;
+		pStack[numStackNodes].mask		= mask;
+		numStackNodes++;
+		while (numStackNodes)
+		{
+			const Cull cullT = pStack[--numStackNodes];
+			const Hot& hotT = _pHot[cullT.nodeId];
+			_ui maskT = cullT.mask;
+			if (hotT.childId[s_childLId]<_numNodes)							// branch node
+			{
+				if (maskT && !intersectionVolume(volume, hotT.aabb, maskT)) continue;
+				pStack[numStackNodes].nodeId	= hotT.childId[s_childRId];
+				pStack[numStackNodes].mask		= maskT;
+				numStackNodes++;
+				pStack[numStackNodes].nodeId	= hotT.childId[s_childLId];
+				pStack[numStackNodes].mask		= maskT;
+				numStackNodes++;
+				continue;
+			}
+			if (maskT && !intersectionVolume(volume, _pNode[cullT.nodeId].aabbTight, maskT)) continue;	// leaf node
+			if (numNodeIds<numNodeIdsMax) pNodeId[numNodeIds] = cullT.nodeId;
+			numNodeIds++;
+		}
+		if (pStack!=stack) try	{	delete[] pStack;	}	catch(...)	{};
+		return numNodeIds;
 	}
 
-
-
-	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::sortX(_ui iLo, _ui iHi)
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::intersectionVolume(const Volume& volume, const AABB3<type>& aabb, _ui& mask) const
 	{
-		if (iLo>=iHi) return;
-		register _ui lo = iLo;
-		register _ui hi = iHi;
-		register _ui mid = (lo + hi)>>1;
-		const type val = _pNode[mid].elem.avg.x;
-		do
+		// mask is cleared for planes AABB is completely inside of, sphere and oriented box use one bit
+		if (volume.volumeType==s_volumeSphere)
+		{
+			if (aabb.distance2(volume.center)>volume.radius2) return false;
+			if (aabb.distance2Max(volume.center)<=volume.radius2) mask = 0;
+			return true;
+		}
+		if (volume.volumeType==s_volumeOBB)
+		{
+			const OBB& obb = *volume.pOBB;
+			if (!aabb.intersectOBB(obb.center, obb.axis[0], obb.axis[1], obb.axis[2], obb.extent)) return false;
+			if (aabb.insideOBB(obb.center, obb.axis[0], obb.axis[1], obb.axis[2], obb.extent)) mask = 0;
+			return true;
+		}
+		for (_ui planeId = 0, maskT = mask; maskT; planeId++, maskT >>= 1)
 		{
-			while (_pNode[lo].elem.avg.x<=val && lo<mid) lo++;
-			while (_pNode[hi].elem.avg.x>=val && hi>mid) hi--;
-			if (lo<hi) __swap<Node>(_pNode[lo], _pNode[hi]);
-		} while ((lo^mid) & (hi^mid));
-		if (hi>iLo) sortX(iLo, hi-1);
-		if (lo<iHi) sortX(lo+1, iHi);
+			if (!(maskT & 1)) continue;
+			const Plane& plane = volume.pPlane[planeId];
+			if (aabb.outsidePlane(plane.normal, plane.offset)) return false;
+			if (aabb.insidePlane(plane.normal, plane.offset)) mask &= ~((_ui)1<<planeId);
+		}
+		return true;
 	}
 
-	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::sortY(_ui iLo, _ui iHi)
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::heapPush(Heap& heap, _ui nodeId, const type& dist2) const
 	{
-		if (iLo>=iHi) return;
-		register _ui lo = iLo;
-		register _ui hi = iHi;
-		register _ui mid = (lo + hi)>>1;
-		const type val = _pNode[mid].elem.avg.y;
-		do
+		if (heap.numNear>=heap.numNearMax)
+		{
+			// heap is doubled
+			Near* pNear = NULL;
+			try
+			{
+				pNear = new Near[heap.numNearMax*2];
+			}
+			catch(...)
+			{
+				return false;
+			}
+			for (_ui i = 0; i<heap.numNear; i++)
+				pNear[i] = heap.pNear[i];
+			if (heap.bOwn) try	{	delete[] heap.pNear;	}	catch(...)	{};
+			heap.pNear		= pNear;
+			heap.numNearMax	*= 2;
+			heap.bOwn		= true;
+		}
+		// sift up
+		_ui i = heap.numNear++;
+		while (i>0)
 		{
-			while (_pNode[lo].elem.avg.y<=val && lo<mid) lo++;
-			while (_pNode[hi].elem.avg.y>=val && hi>mid) hi--;
-			if (lo<hi) __swap<Node>(_pNode[lo], _pNode[hi]);
-		} while ((lo^mid) & (hi^mid));
-		if (hi>iLo) sortY(iLo, hi-1);
-		if (lo<iHi) sortY(lo+1, iHi);
+			const _ui p = (i-1)>>1;
+			if (heap.pNear[p].dist2<=dist2) break;
+			heap.pNear[i] = heap.pNear[p];
+			i = p;
+		}
+		heap.pNear[i].nodeId	= nodeId;
+		heap.pNear[i].dist2		= dist2;
+		return true;
 	}
 
-	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::sortZ(_ui iLo, _ui iHi)
+	template <class callBack, typename type, typename data> typename BVH3<callBack, type, data>::Near __fastcall BVH3<callBack, type, data>::heapPop(Heap& heap) const
 	{
-		if (iLo>=iHi) return;
-		register _ui lo = iLo;
-		register _ui hi = iHi;
-		register _ui mid = (lo + hi)>>1;
-		const type val = _pNode[mid].elem.avg.z;
-		do
+		const Near nearT = heap.pNear[0];
+		const Near nearL = heap.pNear[--heap.numNear];
+		// sift down
+		_ui i = 0;
+		for (;;)
 		{
-			while (_pNode[lo].elem.avg.z<=val && lo<mid) lo++;
-			while (_pNode[hi].elem.avg.z>=val && hi>mid) hi--;
-			if (lo<hi) __swap<Node>(_pNode[lo], _pNode[hi]);
-		} while ((lo^mid) & (hi^mid));
-		if (hi>iLo) sortZ(iLo, hi-1);
-		if (lo<iHi) sortZ(lo+1, iHi);
+			_ui c = i*2+1;
+			if (c>=heap.numNear) break;
+			if (c+1<heap.numNear && heap.pNear[c+1].dist2<heap.pNear[c].dist2) c++;
+			if (nearL.dist2<=heap.pNear[c].dist2) break;
+			heap.pNear[i] = heap.pNear[c];
+			i = c;
+		}
+		if (heap.numNear) heap.pNear[i] = nearL;
+		return nearT;
 	}
 
-
-
-	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::sort(_ui iLo, _ui iHi, _ui level)
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::intersectionPacket(const Packet& packet, const AABB3<type>& aabb, _ui mask) const
 	{
-		if (iLo==iHi) return iLo;
-		if (_numNodes>=_numNodesMax) return _numNodesMax;
-		const _ui i = level % 3;
-		switch (i)
+		// all rays are checked without branches, so loop is vectorized, rays out of mask are dropped at the end
+		_ui hit[s_numPacketRays];
+		for (_ui i = 0; i<s_numPacketRays; i++)
 		{
-			case 0 : sortX(iLo, iHi); break;
-			case 1 : sortY(iLo, iHi); break;
-			case 2 : sortZ(iLo, iHi); break;
+			const type ax = (aabb.l.x-packet.ox[i])*packet.ix[i];	const type bx = (aabb.h.x-packet.ox[i])*packet.ix[i];
+			const type ay = (aabb.l.y-packet.oy[i])*packet.iy[i];	const type by = (aabb.h.y-packet.oy[i])*packet.iy[i];
+			const type az = (aabb.l.z-packet.oz[i])*packet.iz[i];	const type bz = (aabb.h.z-packet.oz[i])*packet.iz[i];
+			const _b px = packet.ix[i]==(const type)0;
+			const _b py = packet.iy[i]==(const type)0;
+			const _b pz = packet.iz[i]==(const type)0;
+			// parallel axis doesn't limit ray, but origin has to be inside of slab
+			const _b bIn =	((!px) | ((packet.ox[i]>=aabb.l.x) & (packet.ox[i]<=aabb.h.x))) &
+							((!py) | ((packet.oy[i]>=aabb.l.y) & (packet.oy[i]<=aabb.h.y))) &
+							((!pz) | ((packet.oz[i]>=aabb.l.z) & (packet.oz[i]<=aabb.h.z)));
+			const type tl = Math::max<type>(Math::max<type>(px ? (const type)0 : Math::min<type>(ax, bx), py ? (const type)0 : Math::min<type>(ay, by)),
+											Math::max<type>(pz ? (const type)0 : Math::min<type>(az, bz), (const type)0));
+			const type th = Math::min<type>(Math::min<type>(px ? packet.t[i] : Math::max<type>(ax, bx), py ? packet.t[i] : Math::max<type>(ay, by)),
+											Math::min<type>(pz ? packet.t[i] : Math::max<type>(az, bz), packet.t[i]));
+			hit[i] = bIn & (tl<=th);
 		}
-		const _ui iMid = (iLo + iHi)>>1;
-		const _ui nodeLId = sort(iLo,    iMid, level+1);	if (nodeLId>=_numNodesMax) return _numNodesMax;
-		const _ui nodeRId = sort(iMid+1, iHi,  level+1);	if (nodeRId>=_numNodesMax) return _numNodesMax;
-		const _ui nodeTId = _numNodes;
-		Node& nodeL = _pNode[nodeLId];
-		Node& nodeR = _pNode[nodeRId];
-		Node& nodeT = _pNode[nodeTId];
-		nodeL.parentId = nodeTId;
-		nodeR.parentId = nodeTId;
-		nodeT.childId[s_childLId] = nodeLId;
-		nodeT.childId[s_childRId] = nodeRId;
-		nodeT.level = level;
-		updateNode(nodeTId);
-		_numNodes++;
-		return nodeTId;
+		_ui maskHit = 0;
+		for (_ui i = 0; i<s_numPacketRays; i++)
+			maskHit |= hit[i] << i;
+		return maskHit & mask;
 	}
 
-
-	
-	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::swapLeaf(_ui iFrom, _ui iTo)
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::intersectionQuery(const Query& query, const AABB3<type>& aabb, _ui mask, _b bSubAvg) const
 	{
-		Node& nodeF  = _pNode[iFrom];
-		Node& nodeT  = _pNode[iTo];
-		__swap<Node>(nodeF, nodeT);
-		updateParent(iFrom);
-		updateParent(iTo);
-	}
-	
-	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::sortByUid(_ui iLo, _ui iHi)
-	{
-		if (iLo>=iHi) return;
-		register _ui lo = iLo;
-		register _ui hi = iHi;
-		register _ui mid = (lo + hi)>>1;
-		const _ui val = _pNode[mid].uid;
-		do
-		{
-			while (_pNode[lo].uid<=val && lo<mid) lo++;
-			while (_pNode[hi].uid>=val && hi>mid) hi--;
-			if (lo<hi) swapLeaf(lo, hi);
-		} while ((lo^mid) & (hi^mid));
-		if (hi>iLo) sortByUid(iLo, hi-1);
-		if (lo<iHi) sortByUid(lo+1, iHi);
+		// all queries are checked without branches, so loop is vectorized, queries out of mask are dropped at the end
+		_ui hit[s_numPacketQueries];
+		for (_ui i = 0; i<s_numPacketQueries; i++)
+		{
+			const _b bIntersect =	(query.hx[i]>=aabb.l.x) & (aabb.h.x>=query.lx[i]) &
+									(query.hy[i]>=aabb.l.y) & (aabb.h.y>=query.ly[i]) &
+									(query.hz[i]>=aabb.l.z) & (aabb.h.z>=query.lz[i]);
+			const _b bCover =		(query.alx[i]<=aabb.l.x) & (query.ahx[i]>=aabb.h.x) &
+									(query.aly[i]<=aabb.l.y) & (query.ahy[i]>=aabb.h.y) &
+									(query.alz[i]<=aabb.l.z) & (query.ahz[i]>=aabb.h.z);
+			hit[i] = bIntersect & !(bSubAvg & bCover);
+		}
+		_ui maskHit = 0;
+		for (_ui i = 0; i<s_numPacketQueries; i++)
+			maskHit |= hit[i] << i;
+		return maskHit & mask;
 	}
-	
-	
-	
-	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::update(_ui nodeId)
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::checkQuery(const Query& query, _ui numQueries, _b bSubAvg, HitBuffer& hits) const
 	{
-		Node& nodeT = _pNode[nodeId];
-		if (nodeT.maxLeafDistance!=0)		// branch node
+		PacketCast  stack[s_numStackNodes];
+		PacketCast* pStack = stack;
+		const _ui numStackNodesMax = _pNode[_rootNodeId].maxLeafDistance+1;
+		if (numStackNodesMax>s_numStackNodes)
 		{
-			const _ui nodeLId = nodeT.childId[s_childLId];
-			const _ui nodeRId = nodeT.childId[s_childRId];
-			update(nodeLId);
-			update(nodeRId);
-			updateElem(nodeId);
+			try
+			{
+				pStack = new PacketCast[numStackNodesMax];
+			}
+			catch(...)
+			{
+				hits.bLost = true;
+				return;
+			}
+		}
+		_ui numStackNodes = 0;
+		const _ui maskRoot = intersectionQuery(query, _pHot[_rootNodeId].aabb, (1<<numQueries)-1, bSubAvg);
+		if (maskRoot)
+		{
+			pStack[numStackNodes].nodeId	= _rootNodeId;
+			pStack[numStackNodes].mask		= maskRoot;
+			numStackNodes++;
+		}
+		while (numStackNodes)
+		{
+			// queries of node are checked already
+			const PacketCast cast = pStack[--numStackNodes];
+			const Hot& hotT = _pHot[cast.nodeId];
+			if (hotT.childId[s_childLId]<_numNodes)							// branch node
+			{
+				for (_ui childId = 0; childId<s_numChildren; childId++)
+				{
+					const _ui nodeCId = hotT.childId[s_numChildren-1-childId];		// left child is popped first
+					const _ui mask = intersectionQuery(query, _pHot[nodeCId].aabb, cast.mask, bSubAvg);
+					if (!mask) continue;
+					pStack[numStackNodes].nodeId	= nodeCId;
+					pStack[numStackNodes].mask		= mask;
+					numStackNodes++;
+				}
+				continue;
+			}
+			const _ui mask = _bFat ? intersectionQuery(query, _pNode[cast.nodeId].aabbTight, cast.mask, false) : cast.mask;
+			for (_ui i = 0; i<numQueries; i++)								// leaf node
+			{
+				if (!(mask & (1<<i))) continue;
+				addHit(hits, query.queryId[i], cast.nodeId);
+			}
 		}
+		if (pStack!=stack) try	{	delete[] pStack;	}	catch(...)	{};
 	}
 
-	
-	
-	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::intersection(const Node& node, _ui nodeId) const
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::checkRange(Batch& batch, _ui iLo, _ui iHi) const
 	{
-		if (nodeId==_rootNodeId) return true;
-		if (nodeId>=_numNodes) return false;
-		const _ui nodeTId = nodeId;
-		const Node& nodeT = _pNode[nodeTId];
-		if (!node.aabb.intersect(nodeT.aabb)) return false;
-		return true;
+		const _ui numPackets = (batch.numElements + s_numPacketQueries-1) / s_numPacketQueries;
+		Query query;
+		for (_ui task = iLo; task<iHi; task++)
+		{
+			HitBuffer& hits = batch.pBuffer[task];
+			const _ui packetLo = (_ui)((_d)numPackets * task / batch.numTasks);
+			const _ui packetHi = (_ui)((_d)numPackets * (task+1) / batch.numTasks);
+			for (_ui packet = packetLo; packet<packetHi; packet++)
+			{
+				const _ui iElemLo = packet*s_numPacketQueries;
+				const _ui num = Math::min<_ui>(batch.numElements-iElemLo, s_numPacketQueries);
+				for (_ui i = 0; i<s_numPacketQueries; i++)
+				{
+					// rest of packet is filled by copies of the first query, they are never active
+					const _ui queryId = batch.pIndex[iElemLo + (i<num ? i : 0)];
+					const Elem& elem = batch.pElem[queryId];
+					query.lx[i]		= elem.aabb.l.x;		query.ly[i]		= elem.aabb.l.y;		query.lz[i]		= elem.aabb.l.z;
+					query.hx[i]		= elem.aabb.h.x;		query.hy[i]		= elem.aabb.h.y;		query.hz[i]		= elem.aabb.h.z;
+					query.alx[i]	= elem.aabbAvg.l.x;		query.aly[i]	= elem.aabbAvg.l.y;		query.alz[i]	= elem.aabbAvg.l.z;
+					query.ahx[i]	= elem.aabbAvg.h.x;		query.ahy[i]	= elem.aabbAvg.h.y;		query.ahz[i]	= elem.aabbAvg.h.z;
+					query.queryId[i] = queryId;
+				}
+				checkQuery(query, num, batch.bSubAvg, hits);
+			}
+			if (batch.bOrdered) continue;
+			// unordered hits are merged as soon as task is finished
+			const _ui numHitsLo = batch.numHits.fetch_add(hits.numHits);
+			const _ui numHitsTask = Math::min<_ui>(hits.numHits, hits.numHitsMax);
+			for (_ui i = 0; i<numHitsTask && numHitsLo+i<batch.hits.numHitsMax; i++)
+				batch.hits.pHit[numHitsLo+i] = hits.pHit[i];
+		}
 	}
 
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::addHit(HitBuffer& hits, _ui queryId, _ui nodeId) const
+	{
+		if (hits.numHits>=hits.numHitsMax && hits.bGrow)
+		{
+			// owned buffer is doubled
+			const _ui numHitsMax = Math::max<_ui>(hits.numHitsMax*2, 256);
+			Hit* pHit = NULL;
+			try
+			{
+				pHit = new Hit[numHitsMax];
+			}
+			catch(...)
+			{
+				hits.bGrow = false;
+				hits.bLost = true;
+			}
+			if (pHit)
+			{
+				for (_ui i = 0; i<hits.numHits; i++)
+					pHit[i] = hits.pHit[i];
+				try	{	delete[] hits.pHit;	}	catch(...)	{};
+				hits.pHit		= pHit;
+				hits.numHitsMax	= numHitsMax;
+			}
+		}
+		if (hits.numHits<hits.numHitsMax)
+		{
+			hits.pHit[hits.numHits].queryId	= queryId;
+			hits.pHit[hits.numHits].nodeId	= nodeId;
+		}
+		hits.numHits++;
+	}
 
-
-	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::check(const Elem& elem, _ui nodeId, _b& bIntersection, _b bOneIntersection, _b bSubAvg, callBack& callBackClass, callBackIntersectionFunc intersectionFunc) const
+	template <class callBack, typename type, typename data> _ui __fastcall BVH3<callBack, type, data>::castPacket(const Vec3<type>* pOrigin, const Vec3<type>* pDir, type* pT, _ui* pNodeHitId, _ui numRays, _b bAnyHit, callBack& callBackClass, callBackCastFunc castFunc) const
 	{
-		if (bIntersection && bOneIntersection) return true;
-		if (nodeId>=_numNodes) return false;
-		const Node& node = _pNode[nodeId];
-		if (bSubAvg && elem.aabbAvg.cover(node.elem.aabb)) return false;
-		if (elem.aabb.intersect(node.elem.aabb))
+		//
+		// packet of coherent rays goes down the tree together, every node is checked with active rays of packet only,
+		// children are visited in order of direction of packet on axis of the largest distance between them
+		//
+
+		for (_ui i = 0; i<numRays; i++)
+			pNodeHitId[i] = _numNodesMax;
+		if (!_numNodes) return 0;
+		Packet packet;
+		for (_ui i = 0; i<s_numPacketRays; i++)
+		{
+			// rest of packet is filled by copies of the first ray, they are never active
+			const _ui r = i<numRays ? i : 0;
+			const Vec3<type>& o = pOrigin[r];
+			const Vec3<type>& d = pDir[r];
+			packet.ox[i]	= o.x;
+			packet.oy[i]	= o.y;
+			packet.oz[i]	= o.z;
+			packet.ix[i]	= d.x!=(const type)0 ? (const type)1/d.x : (const type)0;
+			packet.iy[i]	= d.y!=(const type)0 ? (const type)1/d.y : (const type)0;
+			packet.iz[i]	= d.z!=(const type)0 ? (const type)1/d.z : (const type)0;
+			packet.t[i]		= pT[r];
+		}
+		PacketCast  stack[s_numStackNodes];
+		PacketCast* pStack = stack;
+		const _ui numStackNodesMax = _pNode[_rootNodeId].maxLeafDistance+1;
+		if (numStackNodesMax>s_numStackNodes)
 		{
-			if (node.maxLeafDistance!=0)		// branch node
+			try
 			{
-				check(elem, node.childId[s_childLId], bIntersection, bOneIntersection, bSubAvg, callBackClass, intersectionFunc);
-				check(elem, node.childId[s_childRId], bIntersection, bOneIntersection, bSubAvg, callBackClass, intersectionFunc);
+				pStack = new PacketCast[numStackNodesMax];
 			}
-			else								// leaf node
+			catch(...)
 			{
-				bIntersection |= (callBackClass.*intersectionFunc)(elem, node.elem);
+				return 0;
 			}
 		}
-		return bIntersection;
+		_ui numStackNodes = 0;
+		_ui maskActive = (1<<numRays)-1;									// rays without any hit (for any hit) or all rays
+		const _ui maskRoot = intersectionPacket(packet, _pHot[_rootNodeId].aabb, maskActive);
+		if (maskRoot)
+		{
+			pStack[numStackNodes].nodeId	= _rootNodeId;
+			pStack[numStackNodes].mask		= maskRoot;
+			numStackNodes++;
+		}
+		while (numStackNodes)
+		{
+			// rays of node are checked already, but some of them could be finished after push
+			const PacketCast cast = pStack[--numStackNodes];
+			const _ui nodeTId = cast.nodeId;
+			const Hot& hotT = _pHot[nodeTId];
+			const _ui mask = cast.mask & maskActive;
+			if (!mask) continue;
+			if (hotT.childId[s_childLId]<_numNodes)							// branch node
+			{
+				// children are checked before pushing, farther child by direction of packet is pushed first
+				const _ui nodeLId = hotT.childId[s_childLId];
+				const _ui nodeRId = hotT.childId[s_childRId];
+				const Hot& hotL = _pHot[nodeLId];
+				const Hot& hotR = _pHot[nodeRId];
+				const _ui maskL = intersectionPacket(packet, hotL.aabb, mask);
+				const _ui maskR = intersectionPacket(packet, hotR.aabb, mask);
+				const Vec3<type> dist = (hotR.aabb.l + hotR.aabb.h) - (hotL.aabb.l + hotL.aabb.h);
+				const Vec3<type>& dir = pDir[0];
+				const type distDir = dist.x*dist.x>=dist.y*dist.y ?
+										(dist.x*dist.x>=dist.z*dist.z ? dist.x*dir.x : dist.z*dir.z) :
+										(dist.y*dist.y>=dist.z*dist.z ? dist.y*dir.y : dist.z*dir.z);
+				const _b bSwap = distDir<(const type)0;					// right child is nearer
+				const _ui maskN = bSwap ? maskR : maskL;
+				const _ui maskF = bSwap ? maskL : maskR;
+				if (maskF)
+				{
+					pStack[numStackNodes].nodeId	= bSwap ? nodeLId : nodeRId;
+					pStack[numStackNodes].mask		= maskF;
+					numStackNodes++;
+				}
+				if (maskN)
+				{
+					pStack[numStackNodes].nodeId	= bSwap ? nodeRId : nodeLId;
+					pStack[numStackNodes].mask		= maskN;
+					numStackNodes++;
+				}
+				continue;
+			}
+			const Node& nodeT = _pNode[nodeTId];
+			const _ui maskTight = _bFat ? intersectionPacket(packet, nodeT.aabbTight, mask) : mask;
+			for (_ui i = 0; i<numRays; i++)									// leaf node
+			{
+				if (!(maskTight & (1<<i))) continue;
+				if (!(callBackClass.*castFunc)(pOrigin[i], pDir[i], pT[i], nodeT.elem)) continue;
+				packet.t[i]		= pT[i];
+				pNodeHitId[i]	= nodeTId;
+				if (bAnyHit) maskActive &= ~(1<<i);
+			}
+			if (!maskActive) break;
+		}
+		if (pStack!=stack) try	{	delete[] pStack;	}	catch(...)	{};
+		_ui numHits = 0;
+		for (_ui i = 0; i<numRays; i++)
+			if (pNodeHitId[i]<_numNodesMax) numHits++;
+		return numHits;
 	}
 
 	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::update(_ui nodeId, callBack& callBackClass, callBackUpdateFunc updateFunc)
 	{
 		if (nodeId>=_numNodes) return false;
-		Node& node = _pNode[nodeId];
-		if (node.maxLeafDistance!=0)		// branch node
+		const Hot& hot = _pHot[nodeId];
+		if (hot.childId[s_childLId]<_numNodes)		// branch node
 		{
-			update(node.childId[s_childLId], callBackClass, updateFunc);
-			update(node.childId[s_childRId], callBackClass, updateFunc);
+			update(hot.childId[s_childLId], callBackClass, updateFunc);
+			update(hot.childId[s_childRId], callBackClass, updateFunc);
 		}
 		else								// leaf node
 		{
-			return (callBackClass.*updateFunc)(node.elem);
+			return updateLeaf(nodeId, callBackClass, updateFunc);
 		}
 		return true;
 	}
 
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::updateLeaf(_ui nodeId, callBack& callBackClass, callBackUpdateFunc updateFunc)
+	{
+		Node& node = _pNode[nodeId];
+		const _b bUpdate = updateLeafElem(nodeId, callBackClass, updateFunc);
+		if (_bFat) node.elem.aabb += _fatMargin;
+		_pHot[nodeId].aabb = node.elem.aabb;
+		return bUpdate;
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::updateLeafElem(_ui nodeId, callBack& callBackClass, callBackUpdateFunc updateFunc)
+	{
+		// callback gets element with tight AABB, leaf is refreshed from it as setLeaf does (bounds are not enlarged yet)
+		Node& node = _pNode[nodeId];
+		node.elem.aabb = node.aabbTight;
+		const _b bUpdate = (callBackClass.*updateFunc)(node.elem);
+		node.aabbTight		= node.elem.aabb;
+		node.elem.aabbAvg	= node.elem.avg;
+		return bUpdate;
+	}
+
+	template <class callBack, typename type, typename data> void __fastcall BVH3<callBack, type, data>::refitRange(Refit& refit, _ui iLo, _ui iHi)
+	{
+		//
+		// first child arrived to node stops, second one recalculates node and continues to root,
+		// both children of node are ready at that moment, so no locks are needed
+		//
+
+		for (_ui nodeId = iLo; nodeId<iHi; nodeId++)
+		{
+			if (!exist(nodeId)) continue;
+			if (_pNode[nodeId].maxLeafDistance!=0) continue;				// branch node
+			if (!updateLeaf(nodeId, *refit.pCallBackClass, refit.updateFunc))
+				refit.bUpdate.store(false, std::memory_order_relaxed);
+			for (_ui nodePId = _pNode[nodeId].parentId; nodePId<_numNodes; nodePId = _pNode[nodePId].parentId)
+			{
+				if (refit.pArrival[nodePId].fetch_add(1, std::memory_order_acq_rel)==0) break;
+				updateElem(nodePId);
+			}
+		}
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::refitLeaf(_ui nodeId, callBack& callBackClass, callBackUpdateFunc updateFunc)
+	{
+		// update element of leaf, true if bounds or average of leaf are changed
+		Node& node = _pNode[nodeId];
+		const Vec3<type>  avg		= node.elem.avg;
+		const AABB3<type> aabb		= node.elem.aabb;
+		const AABB3<type> aabbAvg	= node.elem.aabbAvg;
+		updateLeafElem(nodeId, callBackClass, updateFunc);
+		if (_bFat)
+		{
+			// element is still inside of enlarged AABB, keep leaf bounds and average as they are (parent is not recalculated)
+			if (aabb.cover(node.aabbTight))
+			{
+				node.elem.avg		= avg;
+				node.elem.aabb		= aabb;
+				node.elem.aabbAvg	= aabbAvg;
+				return false;
+			}
+			node.elem.aabb += _fatMargin;
+		}
+		_pHot[nodeId].aabb = node.elem.aabb;
+		return !(node.elem.aabb==aabb && node.elem.aabbAvg==aabbAvg && node.elem.avg==avg);
+	}
+
+	template <class callBack, typename type, typename data> _b __fastcall BVH3<callBack, type, data>::refitNode(_ui nodeId, _ui& numRefit)
+	{
+		//
+		// only marked nodes are visited, node is recalculated if bounds or average of any child are changed,
+		// average of node is weighted mean of averages of children, so it's compared with bounds to stop at unchanged node
+		//
+
+		if (nodeId>=_numNodes) return false;
+		Node& nodeT = _pNode[nodeId];
+		if (!nodeT.bRefit) return false;
+		nodeT.bRefit = false;
+		const Hot& hotT = _pHot[nodeId];
+		if (hotT.childId[s_childLId]>=_numNodes) return true;				// changed leaf
+		const _b bChangedL = refitNode(hotT.childId[s_childLId], numRefit);
+		const _b bChangedR = refitNode(hotT.childId[s_childRId], numRefit);
+		if (!bChangedL && !bChangedR) return false;
+		const Vec3<type>  avg		= nodeT.elem.avg;
+		const AABB3<type> aabb		= hotT.aabb;
+		const AABB3<type> aabbAvg	= nodeT.elem.aabbAvg;
+		updateElem(nodeId);
+		numRefit++;
+		return !(hotT.aabb==aabb && nodeT.elem.aabbAvg==aabbAvg && nodeT.elem.avg==avg);
+	}
+
 
 
 
@@ -0,0 +1,416 @@
+// (c) Micelanholies 2015
+// Micelanholies Physics Engine
+// QBVH3 - Quantized Bounding Volume Hierarchy 3d compressed from BVH3
+
+#ifndef	__MPE_QBVH3__
+#define	__MPE_QBVH3__
+
+#include "MpeVec3.h"
+#include "MpeAABB3.h"
+#include "MpeBVH3.h"
+
+
+namespace Mpe
+{
+
+	//
+	// bounds of children are kept as integers (quant is unsigned char or unsigned short) relative to bounds of parent,
+	// bounds of parent are decoded on the way down, so only bounds of root are kept in full precision.
+	// node of 8-bit tree takes 20 bytes and node of 16-bit tree takes 32 bytes for any type,
+	// leaves with elements are kept apart of nodes, maintenance data of BVH3 is dropped.
+	// low bound is decoded from low bound of parent and high bound from high bound of parent,
+	// both are rounded outward against decoded bounds of parent, so decoded child always covers its leaves
+	// and queries are conservative, leaves are tested by their tight bounds exactly.
+	// without bSubAvg check gives the same leaves as check of BVH3, with bSubAvg covered nodes are skipped
+	// by decoded bounds instead of bounds of BVH3 (they are enlarged in fat mode), so other nodes could be skipped.
+	// callbacks get element of leaf with its tight AABB (BVH3 gives enlarged AABB in fat mode).
+	// tree is a read only snapshot of BVH3, it's built again after BVH3 is changed
+	//
+	//	   parent		 pl                         ph
+	//					 |--+--+--+--+--+--+--+--+--|		step = (ph-pl) / quantMax
+	//	   child			   |cl          ch|
+	//	   decoded		   |--------------------|			l = pl + ql*step, h = ph - (quantMax-qh)*step
+	//
+
+	template <class callBack, typename type, typename data, typename quant> class QBVH3
+	{
+
+	public:
+		static const _ui  s_numChildren	= 2;							// total number of children per node
+
+		typedef BVH3<callBack, type, data> Tree;
+		typedef typename Tree::Elem Elem;
+		typedef typename Tree::callBackIntersectionFunc callBackIntersectionFunc;
+		typedef typename Tree::callBackCastFunc callBackCastFunc;
+
+	private:
+		static const _ui s_leafBit		= 0x80000000;					// child index is index of leaf
+		static const _ui s_quantMax		= (quant)~(quant)0;				// maximal quantized coordinate
+		static const _ui s_numStackNodes	= 64;							// number of nodes of traversal stack on thread stack, deeper trees allocate it
+
+		struct Node
+		{
+			quant		lx[s_numChildren];								// low corners of AABB of children relative to AABB of node
+			quant		ly[s_numChildren];
+			quant		lz[s_numChildren];
+			quant		hx[s_numChildren];								// high corners of AABB of children relative to AABB of node
+			quant		hy[s_numChildren];
+			quant		hz[s_numChildren];
+			_ui			childId[s_numChildren];							// index of child node or index of leaf with leaf bit
+		};
+
+		struct Leaf
+		{
+			_ui			nodeId;											// index of leaf node of BVH3
+			Elem		elem;											// element of leaf with tight AABB
+		};
+
+		struct Cast
+		{
+			_ui			childId;										// index of child node or index of leaf with leaf bit
+			AABB3<type>	aabb;											// decoded AABB of child
+			type		tNear;											// distance of entry of ray into child
+		};
+
+
+	private:
+		Node*		_pNode;												// nodes of quantized BVH in depth first order, root is first
+		Leaf*		_pLeaf;												// leaves of quantized BVH
+		_ui			_numNodes;											// number of nodes
+		_ui			_numLeaves;											// number of leaves
+		_ui			_rootChildId;										// index of root node or index of leaf with leaf bit for tree of one leaf
+		AABB3<type>	_aabbRoot;											// AABB of root in full precision
+		_ui			_numStackNodesMax;									// size of traversal stack (depth of tree)
+		_ui			_nodeIdNone;										// index of no node of BVH3 (maximal number of its nodes)
+
+	public:
+		QBVH3(void);
+		~QBVH3(void);
+
+		_b   __fastcall		build(const Tree& bvh);						// quantize built BVH, BVH3 isn't referenced after
+
+		_ui  __fastcall		numNodes(void) const;
+		_ui  __fastcall		numLeaves(void) const;
+
+		_b   __fastcall		check(const Elem& elem, _b bOneIntersection, _b bSubAvg, callBack& callBackClass, callBackIntersectionFunc intersectionFunc) const;	// bSubAvg skips nodes by decoded bounds, not by bounds of BVH3
+		_ui  __fastcall		cast(const Vec3<type>& origin, const Vec3<type>& dir, type& t, _b bAnyHit, callBack& callBackClass, callBackCastFunc castFunc) const;	// closest (or any) leaf hit by origin+dir*[0..t], return index of leaf node of BVH3
+
+	private:
+		void __fastcall		reset(void);
+		void __fastcall		flush(void);
+
+		void __fastcall		bound(const Tree& bvh, _ui nodeId, AABB3<type>* pAABB) const;									// O(N)
+		_ui  __fastcall		compress(const Tree& bvh, _ui nodeId, const AABB3<type>& aabb, const AABB3<type>* pAABB, _ui depth);	// O(N)
+		_ui  __fastcall		addLeaf(const Tree& bvh, _ui nodeId);															// O(1)
+
+		void __fastcall		quantize(const type& l, const type& h, const type& stepAxis, const type& cl, const type& ch, quant& ql, quant& qh) const;	// O(1)
+		Vec3<type> __fastcall	step(const AABB3<type>& aabb) const;														// O(1)
+		void __fastcall		decode(const AABB3<type>& aabb, const Vec3<type>& stepAABB, const Node& node, _ui childId, AABB3<type>& aabbChild) const;	// O(1)
+		type __fastcall		decodeL(const type& l, const type& stepAxis, _ui q) const;										// O(1)
+		type __fastcall		decodeH(const type& h, const type& stepAxis, _ui q) const;										// O(1)
+	};
+
+
+
+	template <class callBack, typename type, typename data, typename quant> QBVH3<callBack, type, data, quant>::QBVH3(void)
+	{
+		reset();
+	}
+
+	template <class callBack, typename type, typename data, typename quant> QBVH3<callBack, type, data, quant>::~QBVH3(void)
+	{
+		flush();
+	}
+
+
+
+	template <class callBack, typename type, typename data, typename quant> _b __fastcall QBVH3<callBack, type, data, quant>::build(const Tree& bvh)
+	{
+		flush();
+		_nodeIdNone = bvh._numNodesMax;
+		if (!bvh._numNodes) return true;
+		// binary tree of N leaves has N-1 branches
+		const _ui numNodesMax = bvh._numNodes - bvh._numFreeNodes;
+		AABB3<type>* pAABB = NULL;
+		try
+		{
+			_pNode	= new Node[numNodesMax];
+			_pLeaf	= new Leaf[numNodesMax];
+			pAABB	= new AABB3<type>[bvh._numNodes];
+		}
+		catch(...)
+		{
+			try	{	delete[] pAABB;	}	catch(...)	{};
+			flush();
+			_nodeIdNone = bvh._numNodesMax;
+			return false;
+		}
+		// tight bounds of branches, so enlarged leaves of fat mode don't widen decoded bounds
+		bound(bvh, bvh._rootNodeId, pAABB);
+		_aabbRoot = pAABB[bvh._rootNodeId];
+		if (bvh._pHot[bvh._rootNodeId].childId[Tree::s_childLId]<bvh._numNodes)
+			_rootChildId = compress(bvh, bvh._rootNodeId, _aabbRoot, pAABB, 1);
+		else
+			_rootChildId = s_leafBit | addLeaf(bvh, bvh._rootNodeId);	// root is leaf
+		try	{	delete[] pAABB;	}	catch(...)	{};
+		return true;
+	}
+
+
+
+	template <class callBack, typename type, typename data, typename quant> _ui __fastcall QBVH3<callBack, type, data, quant>::numNodes(void) const
+	{
+		return _numNodes;
+	}
+
+	template <class callBack, typename type, typename data, typename quant> _ui __fastcall QBVH3<callBack, type, data, quant>::numLeaves(void) const
+	{
+		return _numLeaves;
+	}
+
+
+
+	template <class callBack, typename type, typename data, typename quant> _b __fastcall QBVH3<callBack, type, data, quant>::check(const Elem& elem, _b bOneIntersection, _b bSubAvg, callBack& callBackClass, callBackIntersectionFunc intersectionFunc) const
+	{
+		if (!_numLeaves) return false;
+		if (!elem.aabb.intersect(_aabbRoot)) return false;
+		if (bSubAvg && elem.aabbAvg.cover(_aabbRoot)) return false;
+		// pending children are siblings of nodes of current path with their decoded bounds
+		Cast  stack[s_numStackNodes];
+		Cast* pStack = stack;
+		if (_numStackNodesMax>s_numStackNodes)
+		{
+			try
+			{
+				pStack = new Cast[_numStackNodesMax];
+			}
+			catch(...)
+			{
+				return false;
+			}
+		}
+		_b  bIntersection = false;
+		_ui numStackNodes = 0;
+		pStack[numStackNodes].childId	= _rootChildId;
+		pStack[numStackNodes].aabb		= _aabbRoot;
+		numStackNodes++;
+		while (numStackNodes)
+		{
+			const Cast cast = pStack[--numStackNodes];
+			if (cast.childId & s_leafBit)									// leaf node, decoded bounds are checked already
+			{
+				const Leaf& leaf = _pLeaf[cast.childId & ~s_leafBit];
+				if (!elem.aabb.intersect(leaf.elem.aabb)) continue;
+				bIntersection |= (callBackClass.*intersectionFunc)(elem, leaf.elem);
+				if (bIntersection && bOneIntersection) break;
+				continue;
+			}
+			// children are checked before pushing
+			const Node& nodeT = _pNode[cast.childId];
+			const Vec3<type> stepT = step(cast.aabb);
+			for (_ui i = s_numChildren; i>0; i--)							// left child is popped first
+			{
+				Cast& child = pStack[numStackNodes];
+				decode(cast.aabb, stepT, nodeT, i-1, child.aabb);
+				if (!elem.aabb.intersect(child.aabb)) continue;
+				if (bSubAvg && elem.aabbAvg.cover(child.aabb)) continue;
+				child.childId = nodeT.childId[i-1];
+				numStackNodes++;
+			}
+		}
+		if (pStack!=stack) try	{	delete[] pStack;	}	catch(...)	{};
+		return bIntersection;
+	}
+
+	template <class callBack, typename type, typename data, typename quant> _ui __fastcall QBVH3<callBack, type, data, quant>::cast(const Vec3<type>& origin, const Vec3<type>& dir, type& t, _b bAnyHit, callBack& callBackClass, callBackCastFunc castFunc) const
+	{
+		if (!_numLeaves) return _nodeIdNone;
+		// axes parallel to ray have zero inversed direction
+		const Vec3<type> invDir(dir.x!=(const type)0 ? (const type)1/dir.x : (const type)0,
+								dir.y!=(const type)0 ? (const type)1/dir.y : (const type)0,
+								dir.z!=(const type)0 ? (const type)1/dir.z : (const type)0);
+		Cast  stack[s_numStackNodes];
+		Cast* pStack = stack;
+		if (_numStackNodesMax>s_numStackNodes)
+		{
+			try
+			{
+				pStack = new Cast[_numStackNodesMax];
+			}
+			catch(...)
+			{
+				return _nodeIdNone;
+			}
+		}
+		_ui nodeHitId = _nodeIdNone;
+		_ui numStackNodes = 0;
+		Cast castT;
+		castT.childId	= _rootChildId;
+		castT.aabb		= _aabbRoot;
+		castT.tNear		= (const type)0;
+		_b bCastT = _aabbRoot.intersectRay(origin, invDir, t, castT.tNear);
+		while (bCastT || numStackNodes)
+		{
+			if (!bCastT)
+			{
+				castT = pStack[--numStackNodes];
+				if (castT.tNear>t) continue;								// behind of closest hit
+			}
+			bCastT = false;
+			if (castT.childId & s_leafBit)									// leaf node
+			{
+				const Leaf& leaf = _pLeaf[castT.childId & ~s_leafBit];
+				if ((callBackClass.*castFunc)(origin, dir, t, leaf.elem))
+				{
+					nodeHitId = leaf.nodeId;
+					if (bAnyHit) break;
+				}
+				continue;
+			}
+			// nearer child is visited next, farther one is pushed
+			const Node& nodeT = _pNode[castT.childId];
+			const Vec3<type> stepT = step(castT.aabb);
+			Cast castL, castR;
+			decode(castT.aabb, stepT, nodeT, Tree::s_childLId, castL.aabb);
+			decode(castT.aabb, stepT, nodeT, Tree::s_childRId, castR.aabb);
+			castL.childId	= nodeT.childId[Tree::s_childLId];
+			castR.childId	= nodeT.childId[Tree::s_childRId];
+			castL.tNear		= (const type)0;
+			castR.tNear		= (const type)0;
+			const _b bL = castL.aabb.intersectRay(origin, invDir, t, castL.tNear);
+			const _b bR = castR.aabb.intersectRay(origin, invDir, t, castR.tNear);
+			if (bL && bR)
+			{
+				const _b bSwap = castR.tNear<castL.tNear;
+				pStack[numStackNodes++] = bSwap ? castL : castR;
+				castT = bSwap ? castR : castL;
+				bCastT = true;
+			}
+			else if (bL)	{ castT = castL;	bCastT = true; }
+			else if (bR)	{ castT = castR;	bCastT = true; }
+		}
+		if (pStack!=stack) try	{	delete[] pStack;	}	catch(...)	{};
+		return nodeHitId;
+	}
+
+
+
+	template <class callBack, typename type, typename data, typename quant> void __fastcall QBVH3<callBack, type, data, quant>::reset(void)
+	{
+		_pNode				= NULL;
+		_pLeaf				= NULL;
+		_numNodes			= 0;
+		_numLeaves			= 0;
+		_rootChildId		= 0;
+		_numStackNodesMax	= 0;
+		_nodeIdNone			= 0;
+	}
+
+	template <class callBack, typename type, typename data, typename quant> void __fastcall QBVH3<callBack, type, data, quant>::flush(void)
+	{
+		try	{	delete[] _pNode;	}	catch(...)	{};
+		try	{	delete[] _pLeaf;	}	catch(...)	{};
+		reset();
+	}
+
+
+
+	template <class callBack, typename type, typename data, typename quant> void __fastcall QBVH3<callBack, type, data, quant>::bound(const Tree& bvh, _ui nodeId, AABB3<type>* pAABB) const
+	{
+		const typename Tree::Hot& hot = bvh._pHot[nodeId];
+		if (hot.childId[Tree::s_childLId]>=bvh._numNodes)					// leaf node
+		{
+			pAABB[nodeId] = bvh._pNode[nodeId].aabbTight;
+			return;
+		}
+		bound(bvh, hot.childId[Tree::s_childLId], pAABB);
+		bound(bvh, hot.childId[Tree::s_childRId], pAABB);
+		pAABB[nodeId] = pAABB[hot.childId[Tree::s_childLId]] + pAABB[hot.childId[Tree::s_childRId]];
+	}
+
+	template <class callBack, typename type, typename data, typename quant> _ui __fastcall QBVH3<callBack, type, data, quant>::compress(const Tree& bvh, _ui nodeId, const AABB3<type>& aabb, const AABB3<type>* pAABB, _ui depth)
+	{
+		// children are quantized against decoded bounds of node, the same bounds are decoded by queries
+		_numStackNodesMax = Math::max<_ui>(_numStackNodesMax, depth+1);
+		const _ui quantId = _numNodes++;
+		const Vec3<type> stepT = step(aabb);
+		for (_ui i = 0; i<s_numChildren; i++)
+		{
+			const _ui nodeCId = bvh._pHot[nodeId].childId[i];
+			const AABB3<type>& aabbC = pAABB[nodeCId];
+			Node& node = _pNode[quantId];									// nodes are not reallocated, so reference is valid
+			quantize(aabb.l.x, aabb.h.x, stepT.x, aabbC.l.x, aabbC.h.x, node.lx[i], node.hx[i]);
+			quantize(aabb.l.y, aabb.h.y, stepT.y, aabbC.l.y, aabbC.h.y, node.ly[i], node.hy[i]);
+			quantize(aabb.l.z, aabb.h.z, stepT.z, aabbC.l.z, aabbC.h.z, node.lz[i], node.hz[i]);
+			if (bvh._pHot[nodeCId].childId[Tree::s_childLId]>=bvh._numNodes)
+			{
+				node.childId[i] = s_leafBit | addLeaf(bvh, nodeCId);
+				continue;
+			}
+			AABB3<type> aabbDecoded;
+			decode(aabb, stepT, node, i, aabbDecoded);
+			node.childId[i] = compress(bvh, nodeCId, aabbDecoded, pAABB, depth+1);
+		}
+		return quantId;
+	}
+
+	template <class callBack, typename type, typename data, typename quant> _ui __fastcall QBVH3<callBack, type, data, quant>::addLeaf(const Tree& bvh, _ui nodeId)
+	{
+		const typename Tree::Node& node = bvh._pNode[nodeId];
+		Leaf& leaf = _pLeaf[_numLeaves];
+		leaf.nodeId		= nodeId;
+		leaf.elem		= node.elem;
+		leaf.elem.aabb	= node.aabbTight;
+		return _numLeaves++;
+	}
+
+
+
+	template <class callBack, typename type, typename data, typename quant> void __fastcall QBVH3<callBack, type, data, quant>::quantize(const type& l, const type& h, const type& stepAxis, const type& cl, const type& ch, quant& ql, quant& qh) const
+	{
+		// estimation is corrected by decoding, so rounding of division doesn't matter,
+		// ends of range are decoded exactly to bounds of parent, which cover child
+		_ui il = 0;
+		_ui ih = s_quantMax;
+		if (stepAxis>(const type)0)
+		{
+			il = (_ui)Math::min<type>(Math::max<type>((cl-l)/stepAxis, (const type)0), (const type)s_quantMax);
+			ih = s_quantMax - (_ui)Math::min<type>(Math::max<type>((h-ch)/stepAxis, (const type)0), (const type)s_quantMax);
+			while (il>0          && decodeL(l, stepAxis, il)>cl)	il--;
+			while (ih<s_quantMax && decodeH(h, stepAxis, ih)<ch)	ih++;
+		}
+		ql = (quant)il;
+		qh = (quant)ih;
+	}
+
+	template <class callBack, typename type, typename data, typename quant> Vec3<type> __fastcall QBVH3<callBack, type, data, quant>::step(const AABB3<type>& aabb) const
+	{
+		return (aabb.h - aabb.l) * ((const type)1 / (const type)s_quantMax);
+	}
+
+	template <class callBack, typename type, typename data, typename quant> void __fastcall QBVH3<callBack, type, data, quant>::decode(const AABB3<type>& aabb, const Vec3<type>& stepAABB, const Node& node, _ui childId, AABB3<type>& aabbChild) const
+	{
+		aabbChild.l.x = decodeL(aabb.l.x, stepAABB.x, node.lx[childId]);
+		aabbChild.l.y = decodeL(aabb.l.y, stepAABB.y, node.ly[childId]);
+		aabbChild.l.z = decodeL(aabb.l.z, stepAABB.z, node.lz[childId]);
+		aabbChild.h.x = decodeH(aabb.h.x, stepAABB.x, node.hx[childId]);
+		aabbChild.h.y = decodeH(aabb.h.y, stepAABB.y, node.hy[childId]);
+		aabbChild.h.z = decodeH(aabb.h.z, stepAABB.z, node.hz[childId]);
+	}
+
+	template <class callBack, typename type, typename data, typename quant> type __fastcall QBVH3<callBack, type, data, quant>::decodeL(const type& l, const type& stepAxis, _ui q) const
+	{
+		// the same expression is used by build and queries, so decoded bounds are the same
+		return l + (const type)q*stepAxis;
+	}
+
+	template <class callBack, typename type, typename data, typename quant> type __fastcall QBVH3<callBack, type, data, quant>::decodeH(const type& h, const type& stepAxis, _ui q) const
+	{
+		return h - (const type)(s_quantMax-q)*stepAxis;
+	}
+
+
+};		// namespace Mpe
+
+
+#endif	// __MPE_QBVH3__
@@ -0,0 +1,432 @@
+// (c) Micelanholies 2015
+// Micelanholies Physics Engine
+// WBVH3 - Wide Bounding Volume Hierarchy 3d collapsed from BVH3
+
+#ifndef	__MPE_WBVH3__
+#define	__MPE_WBVH3__
+
+#include "MpeVec3.h"
+#include "MpeAABB3.h"
+#include "MpeBVH3.h"
+
+
+namespace Mpe
+{
+
+	//
+	// every node keeps bounds of its up to width children as arrays by axes (SoA),
+	// so all children are checked by one loop without branches, which is vectorized
+	// (4 floats per SSE or 8 floats per AVX instruction).
+	// leaves are kept apart of nodes, so traversal doesn't load elements of not intersected leaves.
+	// tree is a snapshot of BVH3, it's built again after BVH3 is changed
+	//
+	//	   BVH3 (binary)				 WBVH3 (width 4)
+	//
+	//			 A							 [B C D E]
+	//		   /   \						/  |  |  \
+	//		  B     F					   .   .  .   .
+	//		 / \   / \
+	//		. . . D   E 	children with largest surface are opened until node has width children
+	//				C ...
+	//
+
+	template <class callBack, typename type, typename data, _ui width> class WBVH3
+	{
+
+	public:
+		static const _ui  s_numChildren	= width;						// maximal number of children per node (4 or 8)
+
+		typedef BVH3<callBack, type, data> Tree;
+		typedef typename Tree::Elem Elem;
+		typedef typename Tree::callBackIntersectionFunc callBackIntersectionFunc;
+		typedef typename Tree::callBackCastFunc callBackCastFunc;
+
+	private:
+		static const _ui s_leafBit		= 0x80000000;					// child index is index of leaf
+		static const _ui s_numStackNodes	= 256;							// number of nodes of traversal stack on thread stack, deeper trees allocate it
+
+		struct Node
+		{
+			type		lx[width];										// low corners of AABB of children by axes
+			type		ly[width];
+			type		lz[width];
+			type		hx[width];										// high corners of AABB of children by axes
+			type		hy[width];
+			type		hz[width];
+			_ui			childId[width];									// index of child node or index of leaf with leaf bit
+			_ui			mask;											// children in use
+		};
+
+		struct Leaf
+		{
+			_ui			nodeId;											// index of leaf node of BVH3
+			Elem		elem;											// element of leaf
+		};
+
+		struct Cast
+		{
+			_ui			childId;										// index of child node or index of leaf with leaf bit
+			type		tNear;											// distance of entry of ray into child
+		};
+
+
+	private:
+		Node*	_pNode;													// nodes of wide BVH, root is first
+		Leaf*	_pLeaf;													// leaves of wide BVH
+		_ui		_numNodes;												// number of nodes
+		_ui		_numLeaves;												// number of leaves
+		_ui		_numStackNodesMax;										// size of traversal stack (children left by every node of deepest path)
+		_ui		_nodeIdNone;											// index of no node of BVH3 (maximal number of its nodes)
+
+	public:
+		WBVH3(void);
+		~WBVH3(void);
+
+		_b   __fastcall		build(const Tree& bvh);						// collapse binary BVH to wide one, BVH3 isn't referenced after
+
+		_ui  __fastcall		numNodes(void) const;
+		_ui  __fastcall		numLeaves(void) const;
+
+		_b   __fastcall		check(const Elem& elem, _b bOneIntersection, _b bSubAvg, callBack& callBackClass, callBackIntersectionFunc intersectionFunc) const;
+		_ui  __fastcall		cast(const Vec3<type>& origin, const Vec3<type>& dir, type& t, _b bAnyHit, callBack& callBackClass, callBackCastFunc castFunc) const;	// closest (or any) leaf hit by origin+dir*[0..t], return index of leaf node of BVH3
+
+	private:
+		void __fastcall		reset(void);
+		void __fastcall		flush(void);
+
+		_ui  __fastcall		collapse(const Tree& bvh, _ui nodeId, _ui depth);												// O(N)
+
+		_ui  __fastcall		intersection(const Elem& elem, const Node& node, _b bSubAvg) const;							// O(1)
+		_ui  __fastcall		intersectionRay(const Vec3<type>& origin, const Vec3<type>& invDir, const type& t, const Node& node, type* pTNear) const;	// O(1)
+	};
+
+
+
+	template <class callBack, typename type, typename data, _ui width> WBVH3<callBack, type, data, width>::WBVH3(void)
+	{
+		reset();
+	}
+
+	template <class callBack, typename type, typename data, _ui width> WBVH3<callBack, type, data, width>::~WBVH3(void)
+	{
+		flush();
+	}
+
+
+
+	template <class callBack, typename type, typename data, _ui width> _b __fastcall WBVH3<callBack, type, data, width>::build(const Tree& bvh)
+	{
+		flush();
+		_nodeIdNone = bvh._numNodesMax;
+		if (!bvh._numNodes) return true;
+		// binary tree of N leaves has N-1 branches, wide tree has not more
+		const _ui numNodesMax = bvh._numNodes - bvh._numFreeNodes;
+		try
+		{
+			_pNode	= new Node[numNodesMax];
+			_pLeaf	= new Leaf[numNodesMax];
+		}
+		catch(...)
+		{
+			flush();
+			_nodeIdNone = bvh._numNodesMax;
+			return false;
+		}
+		const typename Tree::Node& root = bvh._pNode[bvh._rootNodeId];
+		if (root.maxLeafDistance!=0)
+		{
+			collapse(bvh, bvh._rootNodeId, 1);
+			return true;
+		}
+		// root is leaf, it's the only child of root node
+		Node& node = _pNode[_numNodes++];
+		for (_ui i = 0; i<width; i++)
+		{
+			node.lx[i] = node.ly[i] = node.lz[i] = (const type)0;
+			node.hx[i] = node.hy[i] = node.hz[i] = (const type)0;
+			node.childId[i] = 0;
+		}
+		node.lx[0] = root.aabbTight.l.x;	node.hx[0] = root.aabbTight.h.x;
+		node.ly[0] = root.aabbTight.l.y;	node.hy[0] = root.aabbTight.h.y;
+		node.lz[0] = root.aabbTight.l.z;	node.hz[0] = root.aabbTight.h.z;
+		node.childId[0]	= s_leafBit | _numLeaves;
+		node.mask		= 1;
+		_pLeaf[_numLeaves].nodeId	= bvh._rootNodeId;
+		_pLeaf[_numLeaves].elem		= root.elem;
+		_numLeaves++;
+		_numStackNodesMax = width;
+		return true;
+	}
+
+
+
+	template <class callBack, typename type, typename data, _ui width> _ui __fastcall WBVH3<callBack, type, data, width>::numNodes(void) const
+	{
+		return _numNodes;
+	}
+
+	template <class callBack, typename type, typename data, _ui width> _ui __fastcall WBVH3<callBack, type, data, width>::numLeaves(void) const
+	{
+		return _numLeaves;
+	}
+
+
+
+	template <class callBack, typename type, typename data, _ui width> _b __fastcall WBVH3<callBack, type, data, width>::check(const Elem& elem, _b bOneIntersection, _b bSubAvg, callBack& callBackClass, callBackIntersectionFunc intersectionFunc) const
+	{
+		if (!_numNodes) return false;
+		_ui  stack[s_numStackNodes];
+		_ui* pStack = stack;
+		if (_numStackNodesMax>s_numStackNodes)
+		{
+			try
+			{
+				pStack = new _ui[_numStackNodesMax];
+			}
+			catch(...)
+			{
+				return false;
+			}
+		}
+		_b  bIntersection = false;
+		_ui numStackNodes = 0;
+		pStack[numStackNodes++] = 0;
+		while (numStackNodes)
+		{
+			const Node& nodeT = _pNode[pStack[--numStackNodes]];
+			const _ui mask = intersection(elem, nodeT, bSubAvg);
+			for (_ui i = 0; i<width; i++)
+			{
+				if (!((mask>>i) & 1)) continue;
+				const _ui childId = nodeT.childId[i];
+				if (!(childId & s_leafBit))
+				{
+					pStack[numStackNodes++] = childId;
+					continue;
+				}
+				bIntersection |= (callBackClass.*intersectionFunc)(elem, _pLeaf[childId & ~s_leafBit].elem);
+				if (bIntersection && bOneIntersection) break;
+			}
+			if (bIntersection && bOneIntersection) break;
+		}
+		if (pStack!=stack) try	{	delete[] pStack;	}	catch(...)	{};
+		return bIntersection;
+	}
+
+	template <class callBack, typename type, typename data, _ui width> _ui __fastcall WBVH3<callBack, type, data, width>::cast(const Vec3<type>& origin, const Vec3<type>& dir, type& t, _b bAnyHit, callBack& callBackClass, callBackCastFunc castFunc) const
+	{
+		//
+		// children of node are sorted by distance of entry, leaves are checked nearer first,
+		// branches are pushed farther first, so nearer are visited next
+		//
+
+		if (!_numNodes) return _nodeIdNone;
+		// axes parallel to ray have zero inversed direction
+		const Vec3<type> invDir(dir.x!=(const type)0 ? (const type)1/dir.x : (const type)0,
+								dir.y!=(const type)0 ? (const type)1/dir.y : (const type)0,
+								dir.z!=(const type)0 ? (const type)1/dir.z : (const type)0);
+		Cast  stack[s_numStackNodes];
+		Cast* pStack = stack;
+		if (_numStackNodesMax>s_numStackNodes)
+		{
+			try
+			{
+				pStack = new Cast[_numStackNodesMax];
+			}
+			catch(...)
+			{
+				return _nodeIdNone;
+			}
+		}
+		_ui nodeHitId = _nodeIdNone;
+		_ui numStackNodes = 0;
+		pStack[numStackNodes].childId	= 0;
+		pStack[numStackNodes].tNear		= (const type)0;
+		numStackNodes++;
+		while (numStackNodes)
+		{
+			const Cast cast = pStack[--numStackNodes];
+			if (cast.tNear>t) continue;										// behind of closest hit
+			const Node& nodeT = _pNode[cast.childId];
+			type tNear[width];
+			const _ui mask = intersectionRay(origin, invDir, t, nodeT, tNear);
+			// insertion sort of hit children by distance
+			Cast child[width];
+			_ui numChildren = 0;
+			for (_ui i = 0; i<width; i++)
+			{
+				if (!((mask>>i) & 1)) continue;
+				_ui j = numChildren++;
+				for (; j>0 && child[j-1].tNear>tNear[i]; j--)
+					child[j] = child[j-1];
+				child[j].childId	= nodeT.childId[i];
+				child[j].tNear		= tNear[i];
+			}
+			_b bStop = false;
+			_ui numBranches = 0;
+			for (_ui i = 0; i<numChildren; i++)
+			{
+				if (!(child[i].childId & s_leafBit))
+				{
+					child[numBranches++] = child[i];
+					continue;
+				}
+				if (child[i].tNear>t) continue;
+				const Leaf& leaf = _pLeaf[child[i].childId & ~s_leafBit];
+				if ((callBackClass.*castFunc)(origin, dir, t, leaf.elem))
+				{
+					nodeHitId = leaf.nodeId;
+					if (bAnyHit) { bStop = true; break; }
+				}
+			}
+			if (bStop) break;
+			while (numBranches)
+				pStack[numStackNodes++] = child[--numBranches];
+		}
+		if (pStack!=stack) try	{	delete[] pStack;	}	catch(...)	{};
+		return nodeHitId;
+	}
+
+
+
+	template <class callBack, typename type, typename data, _ui width> void __fastcall WBVH3<callBack, type, data, width>::reset(void)
+	{
+		_pNode				= NULL;
+		_pLeaf				= NULL;
+		_numNodes			= 0;
+		_numLeaves			= 0;
+		_numStackNodesMax	= 0;
+		_nodeIdNone			= 0;
+	}
+
+	template <class callBack, typename type, typename data, _ui width> void __fastcall WBVH3<callBack, type, data, width>::flush(void)
+	{
+		try	{	delete[] _pNode;	}	catch(...)	{};
+		try	{	delete[] _pLeaf;	}	catch(...)	{};
+		reset();
+	}
+
+
+
+	template <class callBack, typename type, typename data, _ui width> _ui __fastcall WBVH3<callBack, type, data, width>::collapse(const Tree& bvh, _ui nodeId, _ui depth)
+	{
+		// children of binary branch are opened by largest surface area until there are width of them
+		_ui nodeCId[width];
+		_ui numChildren = 0;
+		nodeCId[numChildren++] = bvh._pHot[nodeId].childId[Tree::s_childLId];
+		nodeCId[numChildren++] = bvh._pHot[nodeId].childId[Tree::s_childRId];
+		while (numChildren<width)
+		{
+			_ui  openId = width;
+			type openArea = (const type)0;
+			for (_ui i = 0; i<numChildren; i++)
+			{
+				const typename Tree::Hot& hotC = bvh._pHot[nodeCId[i]];
+				if (hotC.childId[Tree::s_childLId]>=bvh._numNodes) continue;
+				const type area = hotC.aabb.area();
+				if (openId<width && area<=openArea) continue;
+				openId		= i;
+				openArea	= area;
+			}
+			if (openId>=width) break;									// all children are leaves
+			const typename Tree::Hot& hotO = bvh._pHot[nodeCId[openId]];
+			nodeCId[openId]				= hotO.childId[Tree::s_childLId];
+			nodeCId[numChildren++]		= hotO.childId[Tree::s_childRId];
+		}
+		_numStackNodesMax = Math::max<_ui>(_numStackNodesMax, depth*(width-1)+1);
+		const _ui wideId = _numNodes++;
+		Node& node = _pNode[wideId];
+		node.mask = ((_ui)1<<numChildren)-1;
+		for (_ui i = 0; i<width; i++)
+		{
+			if (i>=numChildren)												// unused child is out of mask
+			{
+				node.lx[i] = node.ly[i] = node.lz[i] = (const type)0;
+				node.hx[i] = node.hy[i] = node.hz[i] = (const type)0;
+				node.childId[i] = 0;
+				continue;
+			}
+			const typename Tree::Node& nodeC = bvh._pNode[nodeCId[i]];
+			const AABB3<type>& aabb = nodeC.maxLeafDistance!=0 ? bvh._pHot[nodeCId[i]].aabb : nodeC.aabbTight;
+			node.lx[i] = aabb.l.x;	node.hx[i] = aabb.h.x;
+			node.ly[i] = aabb.l.y;	node.hy[i] = aabb.h.y;
+			node.lz[i] = aabb.l.z;	node.hz[i] = aabb.h.z;
+			if (nodeC.maxLeafDistance!=0)
+			{
+				node.childId[i] = collapse(bvh, nodeCId[i], depth+1);	// nodes are not reallocated, so reference is valid
+				continue;
+			}
+			node.childId[i] = s_leafBit | _numLeaves;
+			_pLeaf[_numLeaves].nodeId	= nodeCId[i];
+			_pLeaf[_numLeaves].elem		= nodeC.elem;
+			_numLeaves++;
+		}
+		return wideId;
+	}
+
+
+
+	template <class callBack, typename type, typename data, _ui width> _ui __fastcall WBVH3<callBack, type, data, width>::intersection(const Elem& elem, const Node& node, _b bSubAvg) const
+	{
+		// all children are checked without branches, so loop is vectorized, unused children are dropped at the end
+		const type elx = elem.aabb.l.x;		const type ehx = elem.aabb.h.x;
+		const type ely = elem.aabb.l.y;		const type ehy = elem.aabb.h.y;
+		const type elz = elem.aabb.l.z;		const type ehz = elem.aabb.h.z;
+		const type alx = elem.aabbAvg.l.x;	const type ahx = elem.aabbAvg.h.x;
+		const type aly = elem.aabbAvg.l.y;	const type ahy = elem.aabbAvg.h.y;
+		const type alz = elem.aabbAvg.l.z;	const type ahz = elem.aabbAvg.h.z;
+		_ui hit[width];
+		for (_ui i = 0; i<width; i++)
+		{
+			const _b bIntersect =	(ehx>=node.lx[i]) & (node.hx[i]>=elx) &
+									(ehy>=node.ly[i]) & (node.hy[i]>=ely) &
+									(ehz>=node.lz[i]) & (node.hz[i]>=elz);
+			const _b bCover =		(alx<=node.lx[i]) & (ahx>=node.hx[i]) &
+									(aly<=node.ly[i]) & (ahy>=node.hy[i]) &
+									(alz<=node.lz[i]) & (ahz>=node.hz[i]);
+			hit[i] = bIntersect & !(bSubAvg & bCover);
+		}
+		_ui maskHit = 0;
+		for (_ui i = 0; i<width; i++)
+			maskHit |= hit[i] << i;
+		return maskHit & node.mask;
+	}
+
+	template <class callBack, typename type, typename data, _ui width> _ui __fastcall WBVH3<callBack, type, data, width>::intersectionRay(const Vec3<type>& origin, const Vec3<type>& invDir, const type& t, const Node& node, type* pTNear) const
+	{
+		// all children are checked without branches, so loop is vectorized, unused children are dropped at the end,
+		// parallel axis has zero inversed direction, so its slab gives [0..0], its exit is moved to end of ray,
+		// but origin has to be inside of slab
+		const _b px = invDir.x==(const type)0;
+		const _b py = invDir.y==(const type)0;
+		const _b pz = invDir.z==(const type)0;
+		const type ox = origin.x;	const type ix = invDir.x;	const type dx = px ? t : (const type)0;
+		const type oy = origin.y;	const type iy = invDir.y;	const type dy = py ? t : (const type)0;
+		const type oz = origin.z;	const type iz = invDir.z;	const type dz = pz ? t : (const type)0;
+		const type tMax = t;
+		_ui hit[width];
+		for (_ui i = 0; i<width; i++)
+		{
+			const type ax = (node.lx[i]-ox)*ix;	const type bx = (node.hx[i]-ox)*ix;
+			const type ay = (node.ly[i]-oy)*iy;	const type by = (node.hy[i]-oy)*iy;
+			const type az = (node.lz[i]-oz)*iz;	const type bz = (node.hz[i]-oz)*iz;
+			const _b bIn =	(((ox>=node.lx[i]) & (ox<=node.hx[i])) | !px) &
+							(((oy>=node.ly[i]) & (oy<=node.hy[i])) | !py) &
+							(((oz>=node.lz[i]) & (oz<=node.hz[i])) | !pz);
+			const type tl = Math::max<type>(Math::max<type>(Math::min<type>(ax, bx), Math::min<type>(ay, by)),
+											Math::max<type>(Math::min<type>(az, bz), (const type)0));
+			const type th = Math::min<type>(Math::min<type>(Math::max<type>(ax, bx)+dx, Math::max<type>(ay, by)+dy),
+											Math::min<type>(Math::max<type>(az, bz)+dz, tMax));
+			pTNear[i]	= tl;
+			hit[i]		= bIn & (tl<=th);
+		}
+		_ui maskHit = 0;
+		for (_ui i = 0; i<width; i++)
+			maskHit |= hit[i] << i;
+		return maskHit & node.mask;
+	}
+
+
+};		// namespace Mpe
+
+#endif	// __MPE_WBVH3__